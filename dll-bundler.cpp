@@ -1,38 +1,952 @@
 // SPDX-License-Identifier: BSL-1.0
 
 #include <llvm/Object/COFF.h>
+#include <llvm/Object/ELFObjectFile.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/VirtualFileSystem.h>
 #include <llvm/Support/raw_ostream.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/xxhash.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/DataExtractor.h>
+#include <llvm/Support/StringSaver.h>
+#include <llvm/Support/LEB128.h>
+#include <llvm/Support/ConvertUTF.h>
 #include <llvm/ADT/StringSet.h>
+#include <llvm/ADT/StringMap.h>
 #include <getopt.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#endif
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#if defined(__has_include) && !defined(DLL_BUNDLER_NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define DLL_BUNDLER_HAVE_SDT 1
+#endif
+#endif
 #include <vector>
 #include <queue>
+#include <map>
+#include <algorithm>
 #include <string>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <chrono>
+
+// USDT probes for bpftrace/perf under the "dll_bundler" provider, compiled
+// out entirely, arguments included, when <sys/sdt.h> is not available; the
+// arguments are only evaluated while a tracer is attached to the probe,
+// which it tells by setting the probe's semaphore
+#if defined(DLL_BUNDLER_HAVE_SDT)
+#define TRACE_SEMAPHORE(name) \
+    __extension__ unsigned short dll_bundler_##name##_semaphore __attribute__((unused, section(".probes")))
+#define TRACE_ENABLED(name) __builtin_expect(dll_bundler_##name##_semaphore != 0, 0)
+#define TRACE_PROBE1(name, a) do { if (TRACE_ENABLED(name)) DTRACE_PROBE1(dll_bundler, name, a); } while (0)
+#define TRACE_PROBE2(name, a, b) do { if (TRACE_ENABLED(name)) DTRACE_PROBE2(dll_bundler, name, a, b); } while (0)
+#define TRACE_PROBE3(name, a, b, c) do { if (TRACE_ENABLED(name)) DTRACE_PROBE3(dll_bundler, name, a, b, c); } while (0)
+#define TRACE_PROBE4(name, a, b, c, d) do { if (TRACE_ENABLED(name)) DTRACE_PROBE4(dll_bundler, name, a, b, c, d); } while (0)
+TRACE_SEMAPHORE(get_imports__start);
+TRACE_SEMAPHORE(get_imports__done);
+TRACE_SEMAPHORE(find_import__start);
+TRACE_SEMAPHORE(find_import__done);
+TRACE_SEMAPHORE(check_arch__start);
+TRACE_SEMAPHORE(check_arch__done);
+TRACE_SEMAPHORE(copy__start);
+TRACE_SEMAPHORE(copy__done);
+#else
+#define TRACE_PROBE1(name, a) do {} while (0)
+#define TRACE_PROBE2(name, a, b) do {} while (0)
+#define TRACE_PROBE3(name, a, b, c) do {} while (0)
+#define TRACE_PROBE4(name, a, b, c, d) do {} while (0)
+#endif
+// a null-terminated copy of a string, alive until the end of the probe
+#define TRACE_STR(s) llvm::SmallString<256>(s).c_str()
+
+enum class ImageFormat {
+    PE,
+    ELF,
+};
+
+// bytes of a file, at an offset
+struct FileRange {
+    uint64_t offset;
+    std::string data;
+};
+
+struct ImageInfo {
+    ImageFormat format = ImageFormat::PE;
+    llvm::Triple::ArchType arch = llvm::Triple::ArchType::UnknownArch;
+    // ELF directories from RUNPATH, or RPATH, with $ORIGIN expanded
+    std::vector<std::string> runPaths;
+    // the PE names of DLLs among the read-only data, in lower case, for
+    // those which are loaded at run time, looked for when asked
+    bool scanDllNames = false;
+    std::vector<std::string> dllNames;
+    // the parts of the file the imports were read from, kept when asked
+    bool keepReadRanges = false;
+    uint64_t fileSize = 0;
+    std::vector<FileRange> readRanges;
+};
+
+struct DllImport {
+    std::string name;
+    bool delayLoaded = false;
+    uint32_t functionCount = 0;
+};
+
+struct ResolvedDll {
+    std::string name;
+    std::string fullPath;
+    std::vector<DllImport> imports;
+    std::vector<std::string> runPaths;
+    uint64_t size = 0;
+    uint64_t hash = 0;
+    // one of the binaries bundled, which come first
+    bool root = false;
+};
+
+struct LockEntry {
+    std::string name;
+    uint64_t size = 0;
+    uint64_t hash = 0;
+};
+
+// what tells the versions of a library apart from other libraries
+struct LibraryIdentity {
+    std::string productName;
+    std::string version;
+    // sorted, without the version suffixes some libraries give every symbol
+    std::vector<std::string> exports;
+};
+
+struct LoadCost {
+    uint64_t importedFunctions = 0;
+    uint64_t delayImportedFunctions = 0;
+    uint64_t baseRelocations = 0;
+    uint64_t relocationBytes = 0;
+    uint64_t tlsCallbacks = 0;
+    uint64_t sections = 0;
+    uint64_t mappedSize = 0;
+};
+
+struct ImageHeader {
+    uint64_t imageBase = 0;
+    uint32_t sizeOfImage = 0;
+    uint16_t dllCharacteristics = 0;
+    bool relocsStripped = false;
+};
+
+struct IoCounters {
+    std::atomic<uint64_t> stats{0};
+    std::atomic<uint64_t> opens{0};
+    std::atomic<uint64_t> directoryListings{0};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> bytesRead{0};
+    // bytes of memory mapped file buffers currently alive, and the most
+    // there have been at once
+    std::atomic<uint64_t> mappedBytes{0};
+    std::atomic<uint64_t> peakMappedBytes{0};
+};
+
+struct AllocCounters {
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> bytes{0};
+};
+
+// the allocation totals when a phase of the run ended
+struct MemoryPhase {
+    const char *name;
+    uint64_t allocations;
+    uint64_t bytes;
+};
+
+struct CopyJob {
+    std::string from;
+    std::string to;
+    // the same file for the binaries in other directories, written from
+    // the contents read once for the first destination
+    std::vector<std::string> otherDestinations;
+    uint64_t size = 0;
+    // the previously bundled version, which the destination should still be,
+    // to write a patch from
+    bool hasPatchBase = false;
+    uint64_t patchBaseSize = 0;
+    uint64_t patchBaseHash = 0;
+    std::string patchName;
+};
+
+enum class FileAdvice {
+    WillNeed,
+    DontNeed,
+};
+
+struct FileHashEntry {
+    uint64_t size = 0;
+    int64_t mtimeNs = 0;
+    uint64_t hash = 0;
+    // looked up or set by this run, which only keeps those
+    bool seen = false;
+};
+
+// content hashes of files, persisted across runs and keyed by device and
+// inode, which stay valid while the size and modification time match
+class HashCache {
+public:
+    std::error_code load(llvm::StringRef cachePath);
+    std::error_code save(llvm::StringRef cachePath);
+    llvm::ErrorOr<uint64_t> getFileHash(llvm::vfs::FileSystem &fs, llvm::StringRef filePath);
+    void setFileHash(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, uint64_t hash);
+
+private:
+    typedef std::pair<uint64_t, uint64_t> FileId;
+
+    std::mutex mutex;
+    std::map<FileId, FileHashEntry> entries;
+};
+
+struct JournalResolution {
+    ResolvedDll dll;
+    int64_t mtimeNs = 0;
+    // the directory the DLL was found in, as the importer's library paths
+    // may differ from one run to the next
+    std::string searchPath;
+};
+
+struct JournalCopy {
+    std::string from;
+    uint64_t fromSize = 0;
+    int64_t fromMtimeNs = 0;
+    uint64_t toSize = 0;
+    int64_t toMtimeNs = 0;
+};
+
+// the DLLs resolved and copied so far, appended to as the run goes, so that
+// a rerun can take them over while the files keep their size and
+// modification time, and the search paths their modification time
+class Journal {
+public:
+    std::error_code open(llvm::vfs::FileSystem &fs, llvm::StringRef path, const std::vector<std::string> &rootBinaryFiles, const std::vector<std::string> &searchPaths, bool softImports);
+    bool isOpen() const { return os != nullptr; }
+    const JournalResolution *getResolution(llvm::vfs::FileSystem &fs, llvm::StringRef name) const;
+    bool isCopied(llvm::vfs::FileSystem &fs, llvm::StringRef from, llvm::StringRef to) const;
+    void addResolution(llvm::vfs::FileSystem &fs, const ResolvedDll &dll, llvm::StringRef searchPath);
+    void addCopy(llvm::vfs::FileSystem &fs, llvm::StringRef from, llvm::StringRef to);
+    void addFailure() { failures = true; }
+    // the journal of a run which went through is of no more use
+    std::error_code close();
+
+private:
+    void load(llvm::StringRef data, llvm::StringRef header);
+    void append(const std::string &record);
+
+    std::string journalPath;
+    std::atomic<bool> failures{false};
+    std::mutex mutex;
+    std::unique_ptr<llvm::raw_fd_ostream> os;
+    llvm::StringMap<JournalResolution> resolutions;
+    // by destination
+    llvm::StringMap<JournalCopy> copies;
+};
+
+// a dependency graph as stored on disk: interned names sorted for binary
+// search, then forward and reverse adjacency in compressed sparse rows,
+// all read in place from the memory mapped file
+class GraphView {
+public:
+    std::error_code open(llvm::StringRef data);
+    uint32_t size() const { return nodeCount; }
+    llvm::StringRef getName(uint32_t node) const;
+    bool isRoot(uint32_t node) const;
+    llvm::ArrayRef<llvm::support::ulittle32_t> getEdges(uint32_t node, bool reverse) const;
+    // returns size() when there is no node with this name
+    uint32_t find(llvm::StringRef name) const;
+
+private:
+    typedef llvm::support::ulittle32_t Word;
+
+    uint32_t nodeCount = 0;
+    // name offset, name size and flags of each node
+    const Word *nodes = nullptr;
+    const Word *forwardOffsets = nullptr;
+    const Word *forwardTargets = nullptr;
+    const Word *reverseOffsets = nullptr;
+    const Word *reverseTargets = nullptr;
+    llvm::StringRef strings;
+};
+
+// the dependency graphs of every run recorded so far, merged by binary name,
+// with each binary keeping the imports seen by the latest run resolving it
+class GraphDatabase {
+public:
+    std::error_code load(llvm::StringRef databasePath);
+    std::error_code save(llvm::StringRef databasePath);
+    void setImports(llvm::StringRef name, bool root, const std::vector<DllImport> &imports);
+
+private:
+    uint32_t getNode(llvm::StringRef name);
+
+    std::vector<std::string> names;
+    std::vector<bool> roots;
+    std::vector<std::vector<uint32_t>> edges;
+    llvm::StringMap<uint32_t> index;
+};
+
+// the number of copies running at once with -j auto, raised by one after
+// each window of copies which kept up the throughput of the previous one,
+// and halved after one which fell short of it
+class ConcurrencyController {
+public:
+    ConcurrencyController(unsigned initial, unsigned maximum);
+    void acquire();
+    void release(uint64_t bytes, int64_t duration);
+    void cancel();
+    unsigned getLimit() const;
+    unsigned getPeak() const;
+    unsigned getIncreases() const;
+    unsigned getDecreases() const;
+    int64_t getMeanLatency() const;
+
+private:
+    unsigned limit;
+    unsigned maximum;
+    unsigned active = 0;
+    unsigned peak;
+    unsigned increases = 0;
+    unsigned decreases = 0;
+    uint64_t operations = 0;
+    int64_t totalLatency = 0;
+    // the current window
+    std::chrono::steady_clock::time_point windowStart;
+    uint64_t windowOperations = 0;
+    uint64_t windowBytes = 0;
+    double lastThroughput = 0;
+    mutable std::mutex mutex;
+    std::condition_variable released;
+};
+
+struct CopyOptions {
+    bool fileAdvice = true;
+    // skips copies whose destination already has the same contents
+    HashCache *hashCache = nullptr;
+    // files at least this large bypass the page cache, 0 disables
+    uint64_t directIoThreshold = 0;
+    // where patches from the previous versions are written, if anywhere
+    std::string patchDir;
+    Journal *journal = nullptr;
+    ConcurrencyController *concurrency = nullptr;
+};
+
+// a bounded queue of copy jobs, which hands out the largest pending job
+// first, so the longest copies start early and overlap the shorter ones
+class CopyQueue {
+public:
+    explicit CopyQueue(size_t capacity);
+    void push(CopyJob job);
+    bool pop(CopyJob &job);
+    void close();
+
+private:
+    static bool smallerJob(const CopyJob &a, const CopyJob &b);
+
+    size_t capacity;
+    bool closed = false;
+    std::vector<CopyJob> jobs;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
+
+// forwards to another file system, counting every operation made through it
+class CountingFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+    explicit CountingFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs);
+    llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override;
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override;
+    llvm::vfs::directory_iterator dir_begin(const llvm::Twine &dir, std::error_code &ec) override;
+    const IoCounters &getCounters() const { return counters; }
+
+private:
+    IoCounters counters;
+};
+
+class CountingFile : public llvm::vfs::File {
+public:
+    CountingFile(std::unique_ptr<llvm::vfs::File> file, IoCounters &counters);
+    llvm::ErrorOr<llvm::vfs::Status> status() override;
+    llvm::ErrorOr<std::string> getName() override;
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(const llvm::Twine &name, int64_t fileSize, bool requiresNullTerminator, bool isVolatile) override;
+    std::error_code close() override;
+
+private:
+    std::unique_ptr<llvm::vfs::File> file;
+    IoCounters &counters;
+};
+
+enum class LogLevel {
+    Error,
+    Warning,
+    Info,
+    Verbose,
+};
+
+enum class LogFormat {
+    Text,
+    Ndjson,
+};
+
+// one step of the resolution or the copies, the fields which do not apply
+// are left empty
+struct LogEvent {
+    LogEvent(LogLevel level, const char *kind) : level(level), kind(kind) {}
+
+    LogLevel level;
+    const char *kind;
+    llvm::StringRef name;
+    llvm::StringRef path;
+    llvm::StringRef destination;
+    std::string message;
+    uint64_t bytes = 0;
+    // microseconds spent on the step, negative when not measured
+    int64_t duration = -1;
+};
+
+// diagnostics of the resolver and the copier threads, gathered in a shared
+// buffer and written out in large blocks instead of one write per line
+class Logger {
+public:
+    Logger();
+    void configure(LogLevel level, LogFormat format);
+    bool enabled(LogLevel level) const { return level <= this->level; }
+    void write(const LogEvent &event);
+    // the statistics asked for, written whichever the level
+    void writeStats(const LogEvent &event);
+    void flush();
+
+private:
+    void append(const LogEvent &event, bool writeNow);
+    void writeText(llvm::raw_ostream &os, const LogEvent &event);
+    void writeJson(llvm::raw_ostream &os, const LogEvent &event);
+
+    LogLevel level = LogLevel::Info;
+    LogFormat format = LogFormat::Text;
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::string buffer;
+};
+
+// the parts of a file which were read, by offset; the rest reads as zeros
+struct SparseContents {
+    uint64_t size = 0;
+    std::vector<std::pair<uint64_t, llvm::StringRef>> ranges;
+};
+
+// what the file system returned to the resolver, by path
+struct IoTrace {
+    std::map<std::string, llvm::vfs::Status> statuses;
+    // failures of status and of opening files
+    std::map<std::string, std::error_code> failedStatuses;
+    std::map<std::string, std::vector<llvm::vfs::directory_entry>> listings;
+    std::map<std::string, std::error_code> failedListings;
+    std::map<std::string, SparseContents> contents;
+};
+
+// forwards to another file system, recording every status and directory
+// listing made through it, and the parts of files which the parser reports
+// having read, so they can be replayed later without the original files
+class RecordingFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+    explicit RecordingFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs);
+    llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override;
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override;
+    llvm::vfs::directory_iterator dir_begin(const llvm::Twine &dir, std::error_code &ec) override;
+    void recordStatus(const std::string &path, const llvm::ErrorOr<llvm::vfs::Status> &statusOrError);
+    void recordRanges(llvm::StringRef path, uint64_t size, std::vector<FileRange> ranges);
+    std::error_code save(llvm::StringRef tracePath);
+
+private:
+    std::mutex mutex;
+    IoTrace trace;
+    llvm::BumpPtrAllocator allocator;
+    llvm::StringSaver saver{allocator};
+};
+
+class RecordingFile : public llvm::vfs::File {
+public:
+    RecordingFile(std::unique_ptr<llvm::vfs::File> file, std::string path, RecordingFileSystem &fs);
+    llvm::ErrorOr<llvm::vfs::Status> status() override;
+    llvm::ErrorOr<std::string> getName() override;
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(const llvm::Twine &name, int64_t fileSize, bool requiresNullTerminator, bool isVolatile) override;
+    std::error_code close() override;
+
+private:
+    std::unique_ptr<llvm::vfs::File> file;
+    std::string path;
+    RecordingFileSystem &fs;
+};
+
+// answers from a recorded trace, anything not recorded does not exist; the
+// contents of files point into the trace, kept whole in memory
+class ReplayFileSystem : public llvm::vfs::FileSystem {
+public:
+    std::error_code load(llvm::StringRef tracePath);
+    llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override;
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override;
+    llvm::vfs::directory_iterator dir_begin(const llvm::Twine &dir, std::error_code &ec) override;
+    std::error_code setCurrentWorkingDirectory(const llvm::Twine &path) override;
+    llvm::ErrorOr<std::string> getCurrentWorkingDirectory() const override;
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> traceBuffer;
+    IoTrace trace;
+    std::string workingDirectory;
+};
+
+class ReplayFile : public llvm::vfs::File {
+public:
+    ReplayFile(llvm::vfs::Status status, const SparseContents &contents);
+    llvm::ErrorOr<llvm::vfs::Status> status() override;
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(const llvm::Twine &name, int64_t fileSize, bool requiresNullTerminator, bool isVolatile) override;
+    std::error_code close() override;
+
+private:
+    llvm::vfs::Status fileStatus;
+    const SparseContents &contents;
+};
+
+// iterates over a directory listing already in memory
+class ListedDirIterator : public llvm::vfs::detail::DirIterImpl {
+public:
+    explicit ListedDirIterator(std::vector<llvm::vfs::directory_entry> entries);
+    std::error_code increment() override;
 
+private:
+    std::vector<llvm::vfs::directory_entry> entries;
+    size_t next = 0;
+};
+
+// bounds the bytes of file buffers alive at once: a thread holding none
+// waits for room, while a thread already holding some goes over the budget,
+// as what it waits for could be its own buffers
+class MappingBudget {
+public:
+    explicit MappingBudget(uint64_t limit);
+    void acquire(uint64_t size);
+    void release(uint64_t size);
+    uint64_t getLimit() const { return limit; }
+    uint64_t getPeak() const;
+
+private:
+    uint64_t limit;
+    uint64_t used = 0;
+    uint64_t peak = 0;
+    mutable std::mutex mutex;
+    std::condition_variable released;
+};
+
+// forwards to another file system, with the buffers of the files read
+// through it held within a budget
+class BudgetFileSystem : public llvm::vfs::ProxyFileSystem {
+public:
+    BudgetFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs, MappingBudget &budget);
+    llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> openFileForRead(const llvm::Twine &path) override;
+
+private:
+    MappingBudget &budget;
+};
+
+class BudgetFile : public llvm::vfs::File {
+public:
+    BudgetFile(std::unique_ptr<llvm::vfs::File> file, MappingBudget &budget);
+    llvm::ErrorOr<llvm::vfs::Status> status() override;
+    llvm::ErrorOr<std::string> getName() override;
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> getBuffer(const llvm::Twine &name, int64_t fileSize, bool requiresNullTerminator, bool isVolatile) override;
+    std::error_code close() override;
+
+private:
+    std::unique_ptr<llvm::vfs::File> file;
+    MappingBudget &budget;
+};
+
+// a file buffer which gives its bytes back to the budget when released
+class BudgetMemoryBuffer : public llvm::MemoryBuffer {
+public:
+    BudgetMemoryBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer, MappingBudget &budget, uint64_t size);
+    ~BudgetMemoryBuffer() override;
+    llvm::StringRef getBufferIdentifier() const override { return buffer->getBufferIdentifier(); }
+    BufferKind getBufferKind() const override { return buffer->getBufferKind(); }
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    MappingBudget &budget;
+    uint64_t size;
+};
+
+// a memory mapped file buffer, whose bytes stay counted while it is alive
+class CountedMemoryBuffer : public llvm::MemoryBuffer {
+public:
+    CountedMemoryBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer, IoCounters &counters);
+    ~CountedMemoryBuffer() override;
+    llvm::StringRef getBufferIdentifier() const override { return buffer->getBufferIdentifier(); }
+    BufferKind getBufferKind() const override { return buffer->getBufferKind(); }
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> buffer;
+    IoCounters &counters;
+};
+
+enum {
+    optLoadReport = 256,
+    optDelayReport,
+    optBaseReport,
+    optEmitEnv,
+    optInMemory,
+    optIoStats,
+    optDirectIo,
+    optHashCache,
+    optLock,
+    optDeltaFrom,
+    optMemStats,
+    optLogFormat,
+    optGraphDb,
+    optDb,
+    optReverse,
+    optTransitive,
+    optRoots,
+    optRecordIo,
+    optReplayIo,
+    optPatchDir,
+    optMapBudget,
+    optResume,
+    optLoadOrder,
+    optSoftDeps,
+    optConflictReport,
+};
+
+static const unsigned defaultCopierThreads = 4;
+static const unsigned maxAutoCopierThreads = 16;
+static const unsigned concurrencyWindow = 8;
+static const size_t copyQueueCapacity = 64;
+static const uint64_t defaultDirectIoThreshold = 64 << 20;
+static const size_t directIoAlignment = 4096;
+static const size_t directIoBufferSize = 1 << 20;
+static const size_t hashChunkSize = 8 << 20;
+static const size_t logBufferSize = 64 << 10;
+
+static const char graphDatabaseMagic[8] = {'D', 'L', 'L', 'B', 'G', 'R', 'F', '1'};
+static const uint32_t graphNodeRoot = 1;
+
+static const char ioTraceMagic[8] = {'D', 'L', 'L', 'B', 'I', 'O', 'T', '2'};
+
+// patches copy the blocks of the previous version found again in the new one
+static const char patchMagic[8] = {'D', 'L', 'L', 'B', 'P', 'A', 'T', '1'};
+static const size_t patchBlockSize = 32;
+static const uint8_t patchOpAdd = 0;
+static const uint8_t patchOpCopy = 1;
+
+static const char journalSuffix[] = ".dll-bundler-journal";
+
+static Logger logger;
+
+// heap allocations made through operator new, counted once enabled, before
+// any other thread is started
+static bool allocCountingEnabled = false;
+static AllocCounters allocCounters;
+
+// bytes of the budget held by the current thread
+static thread_local uint64_t budgetHeldBytes = 0;
+
+// a statically imported DLL is proposed for delay-loading when its importers
+// use at most this many of its functions, or when making it delay-loaded
+// would keep at least this many DLLs out of the initial load
+static const uint32_t delayCandidateMaxFunctions = 4;
+static const size_t delayCandidateMinSavedDlls = 2;
+
+// two DLLs are versions of the same library when they share this many
+// exports, and this fraction of all their exports, or a lower one when
+// their VERSIONINFO names the same product
+static const size_t conflictMinSharedExports = 4;
+static const double conflictMinSimilarity = 0.5;
+static const double conflictMinProductSimilarity = 0.2;
+
+// the entry points which the loader, COM or the service host look up in
+// any DLL of a kind, and which tell nothing about the library
+static const char *const conflictIgnoredExports[] = {
+    "DllCanUnloadNow",
+    "DllGetActivationFactory",
+    "DllGetClassObject",
+    "DllGetVersion",
+    "DllInstall",
+    "DllMain",
+    "DllRegisterServer",
+    "DllUnregisterServer",
+    "ServiceMain",
+};
+
+static const uint32_t resourceTypeVersion = 16;
+
+static int runQuery(int argc, char *argv[]);
+static int runPatch(int argc, char *argv[]);
+static std::string getDefaultGraphDatabasePath();
 static llvm::ErrorOr<std::unique_ptr<llvm::object::COFFObjectFile>> openCOFFObject(llvm::MemoryBufferRef mb);
-static llvm::ErrorOr<std::vector<std::string>> getDllImports(llvm::StringRef filePath, llvm::Triple::ArchType *fileArch = nullptr);
-static std::string findImport(llvm::StringRef dllImport, llvm::Triple::ArchType dllArch, const std::vector<std::string> &searchPaths);
-static bool checkFileArchitecture(llvm::StringRef filePath, llvm::Triple::ArchType dllArch);
+static llvm::ErrorOr<std::vector<DllImport>> getDllImports(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, ImageInfo *fileInfo = nullptr);
+static std::vector<DllImport> getCOFFImports(const llvm::object::COFFObjectFile &obj, std::vector<FileRange> *readRanges);
+static std::vector<std::string> getCOFFDllNames(const llvm::object::COFFObjectFile &obj, std::vector<FileRange> *readRanges);
+static void scanDllNames(llvm::StringRef data, llvm::StringSet<> &names);
+static bool isFileNameChar(char c);
+template <class ELFT> static std::vector<DllImport> getELFImports(const llvm::object::ELFFile<ELFT> &elf, llvm::StringRef filePath, std::vector<std::string> *runPaths, std::vector<FileRange> *readRanges);
+static void addHeaderRanges(const llvm::object::ObjectFile &obj, std::vector<FileRange> *readRanges);
+template <class ELFT> static void addELFHeaderRanges(const llvm::object::ELFFile<ELFT> &elf, std::vector<FileRange> *readRanges);
+static void addReadRange(std::vector<FileRange> *readRanges, llvm::StringRef file, const void *begin, uint64_t size);
+template <class ELFT> static const llvm::object::ELFFile<ELFT> &getELFFile(const llvm::object::ELFObjectFile<ELFT> &obj);
+static std::string findImport(llvm::vfs::FileSystem &fs, llvm::StringRef dllImport, ImageFormat dllFormat, llvm::Triple::ArchType dllArch, const std::vector<std::string> &searchPaths, size_t *searchPathIndex = nullptr, RecordingFileSystem *recordingFs = nullptr);
+static bool checkFileArchitecture(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, ImageFormat dllFormat, llvm::Triple::ArchType dllArch, ImageInfo *fileInfo = nullptr);
+static std::error_code writeFile(llvm::StringRef filePath, llvm::StringRef contents);
+static std::error_code cloneFile(llvm::StringRef from, llvm::StringRef to);
+static std::error_code copyFileDirect(llvm::vfs::FileSystem &fs, llvm::StringRef from, llvm::StringRef to);
+static void runCopier(llvm::vfs::FileSystem &fs, CopyQueue &queue, const CopyOptions &options);
+static void adviseFile(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, FileAdvice advice);
+static llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> loadInMemory(llvm::vfs::FileSystem &fs, const std::vector<std::string> &searchPaths, const std::vector<std::string> &rootBinaryFiles);
+static llvm::ErrorOr<LoadCost> getLoadCost(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, ImageHeader *imageHeader = nullptr);
+static void printLoadReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved);
+static void printDelayLoadReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved);
+static void printBaseAddressReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved);
+static void printConflictReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved);
+static void printSoftDependencyReport(const std::vector<ResolvedDll> &resolved, const std::vector<std::pair<size_t, std::string>> &softDependencies);
+static llvm::ErrorOr<LibraryIdentity> getLibraryIdentity(llvm::vfs::FileSystem &fs, llvm::StringRef filePath);
+static llvm::StringRef getVersionResource(const llvm::object::COFFObjectFile &obj);
+static void readVersionStrings(llvm::StringRef resource, size_t begin, size_t end, unsigned depth, llvm::StringMap<std::string> &strings);
+static void printEnvironment(ImageFormat format, const std::vector<std::string> &searchPaths, const std::vector<bool> &usedSearchPaths);
+static void printIoStats(const IoCounters &counters);
+static void addMemoryPhase(std::vector<MemoryPhase> &phases, const char *name);
+static void printMemoryStats(const std::vector<MemoryPhase> &phases, const IoCounters &counters, const MappingBudget *budget);
+static uint64_t getPeakResidentSize();
+static void *allocateCounted(size_t size);
+static int64_t getMicroseconds(std::chrono::steady_clock::time_point since);
+static int64_t getModificationTime(const llvm::vfs::Status &status);
+static bool parseByteSize(llvm::StringRef text, uint64_t &size);
+static uint64_t hashContents(llvm::StringRef data);
+static std::string makePatch(llvm::StringRef oldData, llvm::StringRef newData);
+static llvm::ErrorOr<std::string> applyPatch(llvm::StringRef oldData, llvm::StringRef patch);
+static void writePatch(llvm::vfs::FileSystem &fs, const CopyJob &job, llvm::StringRef patchDir);
+static std::string getDefaultHashCachePath();
+static llvm::ErrorOr<std::vector<LockEntry>> readLockFile(llvm::StringRef lockPath);
+static std::error_code writeLockFile(llvm::StringRef lockPath, const std::vector<ResolvedDll> &resolved);
+static std::vector<size_t> getLoadOrder(const std::vector<ResolvedDll> &resolved);
+static std::error_code writeLoadOrder(llvm::StringRef listPath, const std::vector<ResolvedDll> &resolved, const std::vector<std::string> &destinationDirs, const std::vector<size_t> &rootDestinations);
+static std::vector<std::vector<bool>> getDllDestinations(const std::vector<ResolvedDll> &resolved, const std::vector<size_t> &rootDestinations, size_t destinationCount);
+static std::vector<bool> getStaticallyLoaded(const std::vector<ResolvedDll> &resolved, const llvm::StringMap<size_t> &index, size_t excluded);
+static ImageHeader getImageHeader(const llvm::object::COFFObjectFile &obj);
+static const llvm::object::data_directory *getDataDirectory(const llvm::object::COFFObjectFile &obj, uint32_t index);
 #if LLVM_VERSION_MAJOR < 11
-static llvm::raw_ostream &operator<<(llvm::raw_ostream &os, const std::error_code &ec);
+static bool failed(std::error_code ec);
 #endif
+static bool failed(llvm::Error err);
+#if LLVM_VERSION_MAJOR < 11
+static std::string getErrorMessage(std::error_code ec);
+#endif
+static std::string getErrorMessage(llvm::Error err);
 
 int main(int argc, char *argv[])
 {
+    if (argc >= 2 && llvm::StringRef(argv[1]) == "query")
+        return runQuery(argc - 1, argv + 1);
+    if (argc >= 2 && llvm::StringRef(argv[1]) == "patch")
+        return runPatch(argc - 1, argv + 1);
+
     std::vector<std::string> dllSearchPaths;
+    std::vector<std::string> vfsOverlayFiles;
     bool wantHelp = false;
+    bool wantLoadReport = false;
+    bool wantDelayReport = false;
+    bool wantBaseReport = false;
+    bool wantConflictReport = false;
+    bool wantEmitEnv = false;
+    bool wantInMemory = false;
+    bool wantIoStats = false;
+    bool wantMemStats = false;
+    LogLevel logLevel = LogLevel::Info;
+    LogFormat logFormat = LogFormat::Text;
+    unsigned copierThreads = defaultCopierThreads;
+    bool autoConcurrency = false;
+    CopyOptions copyOptions;
+    std::string hashCachePath;
+    std::string lockPath;
+    std::string deltaBasePath;
+    std::string graphDatabasePath;
+    std::string recordIoPath;
+    std::string replayIoPath;
+    uint64_t mapBudget = 0;
+    bool wantResume = false;
+    std::string loadOrderPath;
+    bool wantSoftDeps = false;
+    bool bundleSoftDeps = false;
+
+    static const option longOptions[] = {
+        {"help", no_argument, nullptr, 'h'},
+        {"load-report", no_argument, nullptr, optLoadReport},
+        {"delay-report", no_argument, nullptr, optDelayReport},
+        {"base-report", no_argument, nullptr, optBaseReport},
+        {"conflict-report", no_argument, nullptr, optConflictReport},
+        {"emit-env", no_argument, nullptr, optEmitEnv},
+        {"in-memory", no_argument, nullptr, optInMemory},
+        {"io-stats", no_argument, nullptr, optIoStats},
+        {"direct-io", optional_argument, nullptr, optDirectIo},
+        {"hash-cache", optional_argument, nullptr, optHashCache},
+        {"lock", required_argument, nullptr, optLock},
+        {"delta-from", required_argument, nullptr, optDeltaFrom},
+        {"mem-stats", no_argument, nullptr, optMemStats},
+        {"log-format", required_argument, nullptr, optLogFormat},
+        {"graph-db", optional_argument, nullptr, optGraphDb},
+        {"record-io", required_argument, nullptr, optRecordIo},
+        {"replay-io", required_argument, nullptr, optReplayIo},
+        {"patch-dir", required_argument, nullptr, optPatchDir},
+        {"map-budget", required_argument, nullptr, optMapBudget},
+        {"resume", no_argument, nullptr, optResume},
+        {"load-order", required_argument, nullptr, optLoadOrder},
+        {"soft-deps", optional_argument, nullptr, optSoftDeps},
+        {"quiet", no_argument, nullptr, 'q'},
+        {"verbose", no_argument, nullptr, 'v'},
+        {nullptr, 0, nullptr, 0},
+    };
 
     if (argc < 2)
         wantHelp = true;
     else {
-        for (int c; (c = getopt(argc, argv, "hL:")) != -1;) {
+        for (int c; (c = getopt_long(argc, argv, "hL:j:qv", longOptions, nullptr)) != -1;) {
             switch (c) {
             case 'h':
                 wantHelp = true;
                 break;
-            case 'L':
-                dllSearchPaths.push_back(optarg);
+            case 'L': {
+                // a YAML file is a VFS overlay, whose virtual directories
+                // can then be named by other search paths
+                llvm::StringRef ext = llvm::sys::path::extension(optarg);
+                if (ext == ".yaml" || ext == ".yml")
+                    vfsOverlayFiles.push_back(optarg);
+                else
+                    dllSearchPaths.push_back(optarg);
+                break;
+            }
+            case 'j':
+                autoConcurrency = llvm::StringRef(optarg) == "auto";
+                if (autoConcurrency)
+                    copierThreads = maxAutoCopierThreads;
+                else if (llvm::StringRef(optarg).getAsInteger(10, copierThreads) || copierThreads == 0) {
+                    llvm::errs() << "Invalid number of copier threads: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case optLoadReport:
+                wantLoadReport = true;
+                break;
+            case optDelayReport:
+                wantDelayReport = true;
+                break;
+            case optBaseReport:
+                wantBaseReport = true;
+                break;
+            case optConflictReport:
+                wantConflictReport = true;
+                break;
+            case optEmitEnv:
+                wantEmitEnv = true;
+                break;
+            case optInMemory:
+                wantInMemory = true;
+                break;
+            case optIoStats:
+                wantIoStats = true;
+                break;
+            case optDirectIo:
+                copyOptions.directIoThreshold = defaultDirectIoThreshold;
+                if (optarg && (!parseByteSize(optarg, copyOptions.directIoThreshold) || copyOptions.directIoThreshold == 0)) {
+                    llvm::errs() << "Invalid direct I/O threshold: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case optHashCache:
+                hashCachePath = optarg ? std::string(optarg) : getDefaultHashCachePath();
+                if (hashCachePath.empty()) {
+                    llvm::errs() << "Cannot determine the cache directory.\n";
+                    return 1;
+                }
+                break;
+            case optLock:
+                lockPath = optarg;
+                break;
+            case optDeltaFrom:
+                deltaBasePath = optarg;
+                break;
+            case optMemStats:
+                wantMemStats = true;
+                break;
+            case optGraphDb:
+                graphDatabasePath = optarg ? std::string(optarg) : getDefaultGraphDatabasePath();
+                if (graphDatabasePath.empty()) {
+                    llvm::errs() << "Cannot determine the cache directory.\n";
+                    return 1;
+                }
+                break;
+            case optRecordIo:
+                recordIoPath = optarg;
+                break;
+            case optReplayIo:
+                replayIoPath = optarg;
+                break;
+            case optPatchDir:
+                copyOptions.patchDir = optarg;
+                break;
+            case optMapBudget:
+                if (!parseByteSize(optarg, mapBudget) || mapBudget == 0) {
+                    llvm::errs() << "Invalid mapping budget: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case optResume:
+                wantResume = true;
+                break;
+            case optLoadOrder:
+                loadOrderPath = optarg;
+                break;
+            case optSoftDeps:
+                wantSoftDeps = true;
+                if (optarg && llvm::StringRef(optarg) == "bundle")
+                    bundleSoftDeps = true;
+                else if (optarg && llvm::StringRef(optarg) != "report") {
+                    llvm::errs() << "Invalid soft dependency mode: " << optarg << "\n";
+                    return 1;
+                }
+                break;
+            case 'q':
+                logLevel = LogLevel::Warning;
+                break;
+            case 'v':
+                logLevel = LogLevel::Verbose;
+                break;
+            case optLogFormat:
+                if (llvm::StringRef(optarg) == "text")
+                    logFormat = LogFormat::Text;
+                else if (llvm::StringRef(optarg) == "ndjson")
+                    logFormat = LogFormat::Ndjson;
+                else {
+                    llvm::errs() << "Invalid log format: " << optarg << "\n";
+                    return 1;
+                }
                 break;
             default:
                 return -1;
@@ -41,11 +955,70 @@ int main(int argc, char *argv[])
     }
 
     if (wantHelp) {
-        llvm::outs() << "Usage: dll-bundler [-L dll-search-path]... <exe-or-dll>\n";
+        llvm::outs() << "Usage: dll-bundler [-L dll-search-path|vfs-overlay.yaml]... [options] <exe-or-dll>...\n"
+                        "       dll-bundler query [--db file] [--reverse] [--transitive] [--roots] <name>...\n"
+                        "       dll-bundler patch <old-file> <patch> <new-file>\n"
+                        "\n"
+                        "Options:\n"
+                        "  -j threads|auto Number of threads copying DLLs (default 4), or as many\n"
+                        "                  as the throughput of the copies benefits from\n"
+                        "  -q, --quiet     Only report errors and DLLs not found\n"
+                        "  -v, --verbose   Also report each DLL resolved, with timings\n"
+                        "  --log-format=text|ndjson\n"
+                        "                  Log one line of text, or one JSON object, per event\n"
+                        "  --load-report   Report the loader work caused by each DLL\n"
+                        "  --delay-report  Report candidates for delay-loading\n"
+                        "  --base-report   Report fixed-base images with colliding ranges\n"
+                        "  --conflict-report\n"
+                        "                  Report the DLLs which are versions of the same\n"
+                        "                  library, and what keeping only one would save\n"
+                        "  --emit-env      Print WINEDLLPATH and WINEPATH, PATH on Windows, or\n"
+                        "                  LD_LIBRARY_PATH for ELF binaries, instead of copying\n"
+                        "  --in-memory     Load the search paths in memory before resolving\n"
+                        "  --io-stats      Report the file system operations performed\n"
+                        "  --direct-io[=size]\n"
+                        "                  Copy files from this size (default 64M) bypassing\n"
+                        "                  the page cache\n"
+                        "  --hash-cache[=file]\n"
+                        "                  Keep DLL content hashes across runs, and skip\n"
+                        "                  copying over identical files\n"
+                        "  --lock file     Record the bundled DLLs and their hashes\n"
+                        "  --delta-from file\n"
+                        "                  Copy only the DLLs which differ from a previous\n"
+                        "                  lock, and list the ones no longer bundled\n"
+                        "  --patch-dir dir With --delta-from, write patches from the previously\n"
+                        "                  bundled versions of the DLLs which changed\n"
+                        "  --mem-stats     Report the heap allocations of each phase, and the\n"
+                        "                  peak resident size and mapped file bytes\n"
+                        "  --map-budget size\n"
+                        "                  Limit the bytes of files mapped or read at once\n"
+                        "  --resume        Keep a journal next to the binary, and take over the\n"
+                        "                  DLLs resolved and copied by an interrupted run\n"
+                        "  --soft-deps[=report|bundle]\n"
+                        "                  Look for the names of DLLs among the strings of each\n"
+                        "                  binary, for those loaded at run time, and report\n"
+                        "                  the ones in the search paths, or bundle them\n"
+                        "  --load-order file\n"
+                        "                  List the bundled files in the order the loader reads\n"
+                        "                  them, to lay out archives and images\n"
+                        "  --graph-db[=file]\n"
+                        "                  Record the dependency graph for later queries\n"
+                        "  --record-io file\n"
+                        "                  Record the file system accesses of the resolver, and\n"
+                        "                  the parts of the binaries it reads\n"
+                        "  --replay-io file\n"
+                        "                  Resolve against recorded accesses, without copying,\n"
+                        "                  and report the time taken\n"
+                        "\n"
+                        "Query options:\n"
+                        "  --db file       Graph database to query (default as --graph-db)\n"
+                        "  --reverse       List the binaries depending on the names instead\n"
+                        "  --transitive    Follow the dependencies all the way\n"
+                        "  --roots         Only list the executables bundled from\n";
         return 0;
     }
 
-    if (argc - optind != 1) {
+    if (argc - optind < 1) {
         llvm::errs() << "Please indicate the binary file.\n";
         return 1;
     }
@@ -55,149 +1028,3914 @@ int main(int argc, char *argv[])
         return 1;
     }
 
-    std::string rootBinaryFile = argv[optind];
-    llvm::StringRef rootBinaryDir = llvm::sys::path::parent_path(rootBinaryFile);
-    llvm::Triple::ArchType dllArch = llvm::Triple::ArchType::UnknownArch;
+    if (!copyOptions.patchDir.empty() && deltaBasePath.empty()) {
+        llvm::errs() << "Patches are made against the lock given with --delta-from.\n";
+        return 1;
+    }
 
-    auto dllImportsOrError = getDllImports(rootBinaryFile, &dllArch);
-    if (std::error_code ec = dllImportsOrError.getError()) {
-        llvm::errs() << ec.message() << "\n";
+    if (!replayIoPath.empty() && (wantLoadReport || wantDelayReport || wantBaseReport || wantConflictReport)) {
+        llvm::errs() << "A trace holds only what the resolver read, not enough for the reports.\n";
         return 1;
     }
 
+    logger.configure(logLevel, logFormat);
+
+    std::vector<MemoryPhase> memoryPhases;
+    if (wantMemStats) {
+        memoryPhases.reserve(4);
+        allocCountingEnabled = true;
+    }
+
+    // each binary gets its DLLs in its own directory
+    std::vector<std::string> rootBinaryFiles(argv + optind, argv + argc);
+    std::vector<std::string> destinationDirs;
+    std::vector<size_t> rootDestinations;
+    for (const std::string &rootBinaryFile : rootBinaryFiles) {
+        llvm::StringRef rootBinaryDir = llvm::sys::path::parent_path(rootBinaryFile);
+        auto it = std::find(destinationDirs.begin(), destinationDirs.end(), rootBinaryDir);
+        rootDestinations.push_back(it - destinationDirs.begin());
+        if (it == destinationDirs.end())
+            destinationDirs.push_back(rootBinaryDir.str());
+    }
+    ImageInfo rootInfo;
+
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs = llvm::vfs::getRealFileSystem();
+
+    // a trace holds the files as the resolver saw them, behind any overlay
+    // and already in memory
+    bool replaying = !replayIoPath.empty();
+    if (replaying) {
+        llvm::IntrusiveRefCntPtr<ReplayFileSystem> replayFs(new ReplayFileSystem());
+        if (std::error_code ec = replayFs->load(replayIoPath)) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = replayIoPath;
+            event.message = ec.message();
+            logger.write(event);
+            return 1;
+        }
+        fs = replayFs;
+        vfsOverlayFiles.clear();
+        wantInMemory = false;
+    }
+
+    if (!vfsOverlayFiles.empty()) {
+        llvm::IntrusiveRefCntPtr<llvm::vfs::OverlayFileSystem> overlayFs(new llvm::vfs::OverlayFileSystem(fs));
+        for (const std::string &overlayFile : vfsOverlayFiles) {
+            auto bufferOrError = fs->getBufferForFile(overlayFile);
+            if (std::error_code ec = bufferOrError.getError()) {
+                LogEvent event(LogLevel::Error, "error");
+                event.path = overlayFile;
+                event.message = ec.message();
+                logger.write(event);
+                return 1;
+            }
+            std::unique_ptr<llvm::vfs::FileSystem> redirectingFs = llvm::vfs::getVFSFromYAML(
+                std::move(*bufferOrError), nullptr, overlayFile, nullptr, fs);
+            if (!redirectingFs) {
+                LogEvent event(LogLevel::Error, "error");
+                event.path = overlayFile;
+                event.message = "invalid VFS overlay";
+                logger.write(event);
+                return 1;
+            }
+            overlayFs->pushOverlay(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem>(redirectingFs.release()));
+        }
+        fs = overlayFs;
+    }
+
+    if (wantInMemory)
+        fs = loadInMemory(*fs, dllSearchPaths, rootBinaryFiles);
+
+    // files already in memory cost nothing more to read
+    std::unique_ptr<MappingBudget> budget;
+    if (mapBudget != 0 && !wantInMemory && !replaying) {
+        budget.reset(new MappingBudget(mapBudget));
+        fs = new BudgetFileSystem(fs, *budget);
+    }
+
+    llvm::IntrusiveRefCntPtr<CountingFileSystem> countingFs;
+    if (wantIoStats || wantMemStats) {
+        countingFs = new CountingFileSystem(fs);
+        fs = countingFs;
+    }
+
+    // only what the resolver looks at is recorded, copying and hashing read
+    // the files past it
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> resolverFs = fs;
+    llvm::IntrusiveRefCntPtr<RecordingFileSystem> recordingFs;
+    if (!recordIoPath.empty()) {
+        recordingFs = new RecordingFileSystem(fs);
+        resolverFs = recordingFs;
+    }
+
+    // the binaries are resolved together, against the same search paths,
+    // so they have to be of the same kind
+    std::chrono::steady_clock::time_point resolutionStart = std::chrono::steady_clock::now();
+    std::vector<ResolvedDll> resolved;
+    std::vector<std::vector<std::string>> rootDllNames;
+    llvm::ErrorOr<std::vector<DllImport>> dllImportsOrError = std::vector<DllImport>();
+    for (const std::string &rootBinaryFile : rootBinaryFiles) {
+        ImageInfo info;
+        info.scanDllNames = wantSoftDeps;
+        info.keepReadRanges = recordingFs != nullptr;
+        dllImportsOrError = getDllImports(*resolverFs, rootBinaryFile, &info);
+        if (std::error_code ec = dllImportsOrError.getError()) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = rootBinaryFile;
+            event.message = ec.message();
+            logger.write(event);
+            return 1;
+        }
+        if (recordingFs)
+            recordingFs->recordRanges(rootBinaryFile, info.fileSize, std::move(info.readRanges));
+        if (resolved.empty())
+            rootInfo = info;
+        else if (info.format != rootInfo.format || info.arch != rootInfo.arch) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = rootBinaryFile;
+            event.message = "not of the format and architecture of " + rootBinaryFiles[0];
+            logger.write(event);
+            return 1;
+        }
+
+        // PE names are matched without regard to case, ELF names are not
+        llvm::StringRef rootName = llvm::sys::path::filename(rootBinaryFile);
+        resolved.push_back({(info.format == ImageFormat::PE) ? rootName.lower() : rootName.str(), rootBinaryFile, dllImportsOrError.get(), info.runPaths});
+        resolved.back().root = true;
+        rootDllNames.push_back(std::move(info.dllNames));
+    }
+
     llvm::StringSet<> processed;
-    std::queue<std::string> toProcess;
+    // each name to resolve comes with the index of the binary importing it
+    std::queue<std::pair<std::string, size_t>> toProcess;
+    std::vector<bool> usedSearchPaths(dllSearchPaths.size());
+    // with several destinations, the DLLs to copy and where are only known
+    // once every binary is resolved
+    std::vector<std::pair<size_t, const LockEntry *>> deferredCopies;
+
+    // page cache hints only make sense when the files come from disk,
+    // and replayed files are not there to be copied
+    copyOptions.fileAdvice = !wantInMemory && !replaying;
+    bool copying = !wantEmitEnv && !replaying;
+
+    std::vector<LockEntry> deltaBase;
+    llvm::StringMap<size_t> deltaBaseIndex;
+    if (!deltaBasePath.empty()) {
+        auto entriesOrError = readLockFile(deltaBasePath);
+        if (std::error_code ec = entriesOrError.getError()) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = deltaBasePath;
+            event.message = ec.message();
+            logger.write(event);
+            return 1;
+        }
+        deltaBase = std::move(*entriesOrError);
+        for (size_t i = 0; i < deltaBase.size(); ++i)
+            deltaBaseIndex[deltaBase[i].name] = i;
+    }
+    bool wantHashes = !lockPath.empty() || !deltaBasePath.empty();
+
+    // in memory files have no stable identity to key hashes with
+    HashCache hashCache;
+    if (!hashCachePath.empty() && !wantInMemory && !replaying) {
+        if (std::error_code ec = hashCache.load(hashCachePath)) {
+            if (ec != std::errc::no_such_file_or_directory) {
+                LogEvent event(LogLevel::Error, "error");
+                event.path = hashCachePath;
+                event.message = ec.message();
+                logger.write(event);
+            }
+        }
+        copyOptions.hashCache = &hashCache;
+    }
+
+    // the journal checks files by their modification time, which in memory
+    // and replayed files do not have
+    Journal journal;
+    std::string journalPath = rootBinaryFiles[0] + journalSuffix;
+    if (wantResume && !wantInMemory && !replaying) {
+        if (std::error_code ec = journal.open(*fs, journalPath, rootBinaryFiles, dllSearchPaths, bundleSoftDeps)) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = journalPath;
+            event.message = ec.message();
+            logger.write(event);
+        }
+        else
+            copyOptions.journal = &journal;
+    }
+
+    // the threads for the most copies allowed, which take turns within the
+    // current limit
+    std::unique_ptr<ConcurrencyController> concurrency;
+    if (autoConcurrency) {
+        concurrency.reset(new ConcurrencyController(defaultCopierThreads, copierThreads));
+        copyOptions.concurrency = concurrency.get();
+    }
 
-    for (const std::string &import : dllImportsOrError.get())
-        toProcess.push(import);
+    // copies run behind the resolution, which only waits when the queue is full
+    CopyQueue copyQueue(copyQueueCapacity);
+    std::vector<std::thread> copiers;
+    for (unsigned i = 0; i < copierThreads && copying; ++i)
+        copiers.emplace_back(runCopier, std::ref(*fs), std::ref(copyQueue), std::cref(copyOptions));
+
+    // one job for all the destinations of a DLL, so that it is read once
+    auto queueCopy = [&](const ResolvedDll &dll, const LockEntry *previous, const std::vector<bool> &destinations) {
+        CopyJob job;
+        job.from = dll.fullPath;
+        job.size = dll.size;
+        for (size_t i = 0; i < destinationDirs.size(); ++i) {
+            if (!destinations[i])
+                continue;
+            llvm::SmallString<256> destinationPath(destinationDirs[i]);
+            llvm::sys::path::append(destinationPath, llvm::sys::path::filename(dll.fullPath));
+            if (copyOptions.journal && journal.isCopied(*fs, job.from, destinationPath)) {
+                LogEvent event(LogLevel::Info, "resume");
+                event.path = destinationPath;
+                logger.write(event);
+            }
+            else if (job.to.empty())
+                job.to = destinationPath.str().str();
+            else
+                job.otherDestinations.push_back(destinationPath.str().str());
+        }
+        if (job.to.empty())
+            return;
+
+        if (previous && !copyOptions.patchDir.empty()) {
+            job.hasPatchBase = true;
+            job.patchBaseSize = previous->size;
+            job.patchBaseHash = previous->hash;
+            job.patchName = dll.name;
+        }
+        copyQueue.push(std::move(job));
+    };
+
+    // the names found among the strings are only of interest when there are
+    // such files to load, which would otherwise go unnoticed
+    llvm::StringSet<> searchIndex;
+    for (size_t i = 0; i < dllSearchPaths.size() && wantSoftDeps; ++i) {
+        std::error_code ec;
+        for (llvm::vfs::directory_iterator it = fs->dir_begin(dllSearchPaths[i], ec), end; !ec && it != end; it.increment(ec))
+            searchIndex.insert(llvm::sys::path::filename(it->path()).lower());
+    }
+    std::vector<std::pair<size_t, std::string>> softDependencies;
+    auto addSoftDependencies = [&](size_t importer, const std::vector<std::string> &names) {
+        for (const std::string &name : names) {
+            ResolvedDll &dll = resolved[importer];
+            auto isImport = [&name](const DllImport &import) { return import.name == name; };
+            if (name == dll.name || !searchIndex.count(name) || std::any_of(dll.imports.begin(), dll.imports.end(), isImport))
+                continue;
+
+            // loaded when the binary decides to, as delay-loaded DLLs are
+            if (bundleSoftDeps) {
+                DllImport import;
+                import.name = name;
+                import.delayLoaded = true;
+                dll.imports.push_back(import);
+                toProcess.push({name, importer});
+            }
+            softDependencies.push_back({importer, name});
+        }
+    };
+
+    // a binary bundled which another imports is already there, and is not
+    // to be looked for, nor copied over itself
+    for (const ResolvedDll &root : resolved)
+        processed.insert(root.name);
+    for (size_t i = 0; i < resolved.size(); ++i) {
+        for (const DllImport &import : resolved[i].imports)
+            toProcess.push({import.name, i});
+        addSoftDependencies(i, rootDllNames[i]);
+    }
+
+    if (wantMemStats)
+        addMemoryPhase(memoryPhases, "setup");
 
     while (!toProcess.empty()) {
-        std::string import = llvm::StringRef(toProcess.front()).lower();
+        std::string import = toProcess.front().first;
+        size_t importer = toProcess.front().second;
         toProcess.pop();
 
         if (!processed.insert(import).second)
             continue;
 
-        std::string fullPath = findImport(import, dllArch, dllSearchPaths);
-        if (fullPath.empty())
+        // the importer's own library paths come before the search paths; only
+        // their count is kept, as adding to resolved moves the importer
+        size_t runPathCount = resolved[importer].runPaths.size();
+        std::vector<std::string> importSearchPaths;
+        if (runPathCount != 0) {
+            importSearchPaths = resolved[importer].runPaths;
+            importSearchPaths.insert(importSearchPaths.end(), dllSearchPaths.begin(), dllSearchPaths.end());
+        }
+
+        std::chrono::steady_clock::time_point resolveStart = std::chrono::steady_clock::now();
+        // the journal has no record of the strings of the DLLs
+        const JournalResolution *journaled = (journal.isOpen() && !wantSoftDeps) ? journal.getResolution(*fs, import) : nullptr;
+        const std::vector<std::string> &searchPaths = (runPathCount == 0) ? dllSearchPaths : importSearchPaths;
+        size_t searchPathIndex = searchPaths.size();
+        std::string fullPath;
+        if (journaled) {
+            fullPath = journaled->dll.fullPath;
+            searchPathIndex = std::find(searchPaths.begin(), searchPaths.end(), journaled->searchPath) - searchPaths.begin();
+        }
+        else
+            fullPath = findImport(*resolverFs, import, rootInfo.format, rootInfo.arch, searchPaths, &searchPathIndex, recordingFs.get());
+        if (fullPath.empty()) {
+            LogEvent event(LogLevel::Warning, "not-found");
+            event.name = import;
+            logger.write(event);
             continue;
+        }
+
+        resolved.push_back({import, fullPath, {}, {}});
+        if (searchPathIndex >= runPathCount && searchPathIndex < searchPaths.size())
+            usedSearchPaths[searchPathIndex - runPathCount] = true;
 
-        llvm::SmallVector<char, 256> destinationPath;
-        llvm::sys::path::append(destinationPath, rootBinaryDir, llvm::sys::path::filename(fullPath));
+        ResolvedDll &dll = resolved.back();
+        if (journaled)
+            dll.size = journaled->dll.size;
+        else if (auto statusOrError = resolverFs->status(fullPath))
+            dll.size = statusOrError->getSize();
 
-        llvm::errs() << fullPath << " -> " << destinationPath << "\n";
-        llvm::sys::fs::copy_file(fullPath, destinationPath);
+        // the whole file is going to be read for copying, have the kernel
+        // start fetching it while the imports are parsed, unless it is
+        // large enough to be copied around the page cache; a journaled DLL
+        // was most likely copied already
+        bool directIo = copyOptions.directIoThreshold != 0 && dll.size >= copyOptions.directIoThreshold;
+        if (copying && copyOptions.fileAdvice && !directIo && !journaled)
+            adviseFile(*fs, fullPath, FileAdvice::WillNeed);
 
-        dllImportsOrError = getDllImports(fullPath);
+        bool unchanged = false;
+        const LockEntry *previous = nullptr;
+        if (wantHashes) {
+            auto hashOrError = hashCache.getFileHash(*fs, fullPath);
+            if (hashOrError)
+                dll.hash = *hashOrError;
+            auto it = deltaBaseIndex.find(import);
+            if (it != deltaBaseIndex.end())
+                previous = &deltaBase[it->second];
+            unchanged = hashOrError && previous && previous->size == dll.size && previous->hash == dll.hash;
+        }
+
+        ImageInfo dllInfo;
+        dllInfo.scanDllNames = wantSoftDeps;
+        dllInfo.keepReadRanges = recordingFs != nullptr;
+        if (journaled) {
+            dllImportsOrError = journaled->dll.imports;
+            dllInfo.runPaths = journaled->dll.runPaths;
+        }
+        else
+            dllImportsOrError = getDllImports(*resolverFs, fullPath, &dllInfo);
+        if (recordingFs && dllImportsOrError)
+            recordingFs->recordRanges(fullPath, dllInfo.fileSize, std::move(dllInfo.readRanges));
         if (std::error_code ec = dllImportsOrError.getError())
             ; // ignore and go on
         else {
-            for (const std::string &import : dllImportsOrError.get())
-                toProcess.push(import);
+            for (const DllImport &import : dllImportsOrError.get())
+                toProcess.push({import.name, resolved.size() - 1});
+            resolved.back().imports = std::move(dllImportsOrError.get());
+            resolved.back().runPaths = std::move(dllInfo.runPaths);
+            addSoftDependencies(resolved.size() - 1, dllInfo.dllNames);
         }
-    }
 
-    return 0;
-}
+        // queued once parsed, as the copier drops the pages of the file from
+        // the cache when done, which the parsing would otherwise read again
+        if (unchanged) {
+            LogEvent event(LogLevel::Info, "unchanged");
+            event.name = import;
+            event.path = fullPath;
+            logger.write(event);
+        }
+        else if (copying) {
+            if (destinationDirs.size() == 1)
+                queueCopy(dll, previous, std::vector<bool>(1, true));
+            else
+                deferredCopies.push_back({resolved.size() - 1, previous});
+        }
+        if (journal.isOpen() && !journaled)
+            journal.addResolution(*fs, resolved.back(), searchPaths[searchPathIndex]);
 
-llvm::ErrorOr<std::unique_ptr<llvm::object::COFFObjectFile>> openCOFFObject(llvm::MemoryBufferRef mb)
-{
-#if LLVM_VERSION_MAJOR >= 11
-    return llvm::expectedToErrorOr(llvm::object::COFFObjectFile::create(mb));
-#else
-    std::error_code ec;
-    std::unique_ptr<llvm::object::COFFObjectFile> obj(new llvm::object::COFFObjectFile(mb, ec));
-    if (ec)
-        return ec;
-    return obj;
-#endif
-}
+        if (logger.enabled(LogLevel::Verbose)) {
+            LogEvent event(LogLevel::Verbose, "resolve");
+            event.name = import;
+            event.path = fullPath;
+            event.bytes = dll.size;
+            event.duration = getMicroseconds(resolveStart);
+            logger.write(event);
+        }
+    }
+    int64_t resolutionTime = getMicroseconds(resolutionStart);
 
-llvm::ErrorOr<std::vector<std::string>> getDllImports(llvm::StringRef filePath, llvm::Triple::ArchType *fileArch)
-{
-    std::vector<std::string> imports;
+    if (!deferredCopies.empty()) {
+        std::vector<std::vector<bool>> dllDestinations = getDllDestinations(resolved, rootDestinations, destinationDirs.size());
+        for (const auto &deferred : deferredCopies)
+            queueCopy(resolved[deferred.first], deferred.second, dllDestinations[deferred.first]);
+    }
 
-    auto sourceOrError = llvm::MemoryBuffer::getFile(filePath);
-    if (std::error_code ec = sourceOrError.getError())
-        return ec;
+    // what the resolution logged comes out before the copies are waited on
+    logger.flush();
 
-    auto objOrError = openCOFFObject(**sourceOrError);
-    if (std::error_code ec = objOrError.getError())
-        return ec;
+    // the copies overlap the resolution, and are accounted with it
+    copyQueue.close();
+    for (std::thread &copier : copiers)
+        copier.join();
 
-    llvm::object::COFFObjectFile &obj = **objOrError;
+    if (wantMemStats)
+        addMemoryPhase(memoryPhases, "resolve");
 
-    if (fileArch)
-        *fileArch = obj.getArch();
+    if (journal.isOpen()) {
+        if (std::error_code ec = journal.close()) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = journalPath;
+            event.message = ec.message();
+            logger.write(event);
+        }
+    }
 
-    for (auto &dir : obj.import_directories()) {
-        llvm::StringRef name;
-        auto ec = dir.getName(name);
-        if (ec)
-            llvm::errs() << ec << "\n";
-        else
-            imports.emplace_back(name);
+    if (copyOptions.hashCache) {
+        if (std::error_code ec = hashCache.save(hashCachePath)) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = hashCachePath;
+            event.message = ec.message();
+            logger.write(event);
+        }
     }
 
-    for (auto &dir : obj.delay_import_directories()) {
-        llvm::StringRef name;
-        auto ec = dir.getName(name);
-        if (ec)
-            llvm::errs() << ec << "\n";
-        else
-            imports.emplace_back(name);
+    if (!lockPath.empty()) {
+        if (std::error_code ec = writeLockFile(lockPath, resolved)) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = lockPath;
+            event.message = ec.message();
+            logger.write(event);
+        }
     }
 
-    return imports;
-}
+    if (!loadOrderPath.empty()) {
+        if (std::error_code ec = writeLoadOrder(loadOrderPath, resolved, destinationDirs, rootDestinations)) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = loadOrderPath;
+            event.message = ec.message();
+            logger.write(event);
+        }
+    }
 
-std::string findImport(llvm::StringRef dllImport, llvm::Triple::ArchType dllArch, const std::vector<std::string> &searchPaths)
-{
-    for (llvm::StringRef dir : searchPaths) {
-        std::error_code ec;
-        llvm::sys::fs::directory_iterator it(dir, ec);
-        if (ec)
-            continue;
-        while (it != llvm::sys::fs::directory_iterator()) {
-            const llvm::sys::fs::directory_entry &ent = *it;
-            llvm::StringRef filePath = ent.path();
-            llvm::StringRef fileName = llvm::sys::path::filename(filePath);
-#if LLVM_VERSION_MAJOR >= 13
-            bool fileNameEqual = fileName.equals_insensitive(dllImport);
-#else
-            bool fileNameEqual = fileName.equals_lower(dllImport);
-#endif
-            if (fileNameEqual) {
-                if (!checkFileArchitecture(filePath, dllArch))
-                    llvm::errs() << "Skipped: " << filePath << "\n";
-                else
-                    return std::string(filePath);
+    // a database which cannot be read is left alone rather than replaced
+    if (!graphDatabasePath.empty()) {
+        GraphDatabase graph;
+        std::error_code ec = graph.load(graphDatabasePath);
+        if (!ec || ec == std::errc::no_such_file_or_directory) {
+            for (const ResolvedDll &dll : resolved) {
+                if (!dll.root) {
+                    graph.setImports(dll.name, false, dll.imports);
+                    continue;
+                }
+                llvm::SmallString<256> rootPath(dll.fullPath);
+                llvm::sys::fs::make_absolute(rootPath);
+                llvm::sys::path::remove_dots(rootPath, true);
+                graph.setImports(rootPath, true, dll.imports);
             }
-            it.increment(ec);
-            if (ec)
-                break;
+            ec = graph.save(graphDatabasePath);
+        }
+        if (ec) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = graphDatabasePath;
+            event.message = ec.message();
+            logger.write(event);
         }
     }
-    return std::string();
-}
+    logger.flush();
 
-bool checkFileArchitecture(llvm::StringRef filePath, llvm::Triple::ArchType dllArch)
-{
-    auto sourceOrError = llvm::MemoryBuffer::getFile(filePath);
-    if (sourceOrError.getError())
-        return false;
+    // the removal list of the delta, in the order of the previous lock
+    if (!deltaBase.empty()) {
+        llvm::StringSet<> bundled;
+        for (const ResolvedDll &dll : resolved) {
+            if (!dll.root)
+                bundled.insert(dll.name);
+        }
+        for (const LockEntry &entry : deltaBase) {
+            if (!bundled.count(entry.name))
+                llvm::outs() << "Removed: " << entry.name << "\n";
+        }
+    }
 
-    auto objOrError = openCOFFObject(**sourceOrError);
-    if (objOrError.getError())
+    if (wantMemStats)
+        addMemoryPhase(memoryPhases, "finish");
+
+    if (wantLoadReport)
+        printLoadReport(*fs, resolved);
+    if (wantDelayReport)
+        printDelayLoadReport(*fs, resolved);
+    if (wantBaseReport)
+        printBaseAddressReport(*fs, resolved);
+    if (wantConflictReport)
+        printConflictReport(*fs, resolved);
+    if (wantSoftDeps)
+        printSoftDependencyReport(resolved, softDependencies);
+    if (wantEmitEnv)
+        printEnvironment(rootInfo.format, dllSearchPaths, usedSearchPaths);
+    if (recordingFs) {
+        if (std::error_code ec = recordingFs->save(recordIoPath)) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = recordIoPath;
+            event.message = ec.message();
+            logger.write(event);
+        }
+    }
+    logger.flush();
+    if (replaying) {
+        LogEvent event(LogLevel::Info, "replay");
+        event.message = std::to_string(resolved.size() - rootBinaryFiles.size()) + " DLLs resolved in " +
+            std::to_string(resolutionTime) + " us";
+        event.duration = resolutionTime;
+        logger.writeStats(event);
+    }
+    if (wantIoStats)
+        printIoStats(countingFs->getCounters());
+    if (wantIoStats && concurrency && copying) {
+        LogEvent event(LogLevel::Info, "concurrency");
+        llvm::raw_string_ostream os(event.message);
+        os << concurrency->getLimit() << " copies at once in the end, "
+           << concurrency->getPeak() << " at most, after " << concurrency->getIncreases() << " increases and "
+           << concurrency->getDecreases() << " decreases, " << concurrency->getMeanLatency() << " us per copy";
+        os.flush();
+        logger.writeStats(event);
+    }
+    if (wantMemStats) {
+        addMemoryPhase(memoryPhases, "reports");
+        printMemoryStats(memoryPhases, countingFs->getCounters(), budget.get());
+    }
+
+    return 0;
+}
+
+int runQuery(int argc, char *argv[])
+{
+    std::string databasePath;
+    bool reverse = false;
+    bool transitive = false;
+    bool rootsOnly = false;
+
+    static const option longOptions[] = {
+        {"db", required_argument, nullptr, optDb},
+        {"reverse", no_argument, nullptr, optReverse},
+        {"transitive", no_argument, nullptr, optTransitive},
+        {"roots", no_argument, nullptr, optRoots},
+        {nullptr, 0, nullptr, 0},
+    };
+
+    for (int c; (c = getopt_long(argc, argv, "", longOptions, nullptr)) != -1;) {
+        switch (c) {
+        case optDb:
+            databasePath = optarg;
+            break;
+        case optReverse:
+            reverse = true;
+            break;
+        case optTransitive:
+            transitive = true;
+            break;
+        case optRoots:
+            rootsOnly = true;
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    if (optind == argc) {
+        llvm::errs() << "Please indicate the names to query.\n";
+        return 1;
+    }
+
+    if (databasePath.empty())
+        databasePath = getDefaultGraphDatabasePath();
+    auto bufferOrError = llvm::MemoryBuffer::getFile(databasePath);
+    if (std::error_code ec = bufferOrError.getError()) {
+        llvm::errs() << databasePath << ": " << ec.message() << "\n";
+        return 1;
+    }
+    GraphView graph;
+    if (std::error_code ec = graph.open((*bufferOrError)->getBuffer())) {
+        llvm::errs() << databasePath << ": " << ec.message() << "\n";
+        return 1;
+    }
+
+    // PE names are recorded in lower case, executables by absolute path
+    std::vector<bool> visited(graph.size());
+    std::vector<uint32_t> toVisit;
+    for (int i = optind; i < argc; ++i) {
+        llvm::StringRef name = argv[i];
+        uint32_t node = graph.find(name);
+        if (node == graph.size())
+            node = graph.find(name.lower());
+        if (node == graph.size()) {
+            llvm::SmallString<256> absolutePath(name);
+            llvm::sys::fs::make_absolute(absolutePath);
+            llvm::sys::path::remove_dots(absolutePath, true);
+            node = graph.find(absolutePath);
+        }
+        if (node == graph.size()) {
+            llvm::errs() << "Not found: " << name << "\n";
+            return 1;
+        }
+        toVisit.push_back(node);
+    }
+
+    std::vector<bool> listed(graph.size());
+    while (!toVisit.empty()) {
+        uint32_t node = toVisit.back();
+        toVisit.pop_back();
+        for (uint32_t next : graph.getEdges(node, reverse)) {
+            listed[next] = true;
+            if (transitive && !visited[next]) {
+                visited[next] = true;
+                toVisit.push_back(next);
+            }
+        }
+    }
+
+    // nodes are sorted by name, which keeps the output sorted too
+    for (uint32_t node = 0; node < graph.size(); ++node) {
+        if (listed[node] && (!rootsOnly || graph.isRoot(node)))
+            llvm::outs() << graph.getName(node) << "\n";
+    }
+    return 0;
+}
+
+int runPatch(int argc, char *argv[])
+{
+    if (argc != 4) {
+        llvm::errs() << "Usage: dll-bundler patch <old-file> <patch> <new-file>\n";
+        return 1;
+    }
+
+    auto oldOrError = llvm::MemoryBuffer::getFile(argv[1]);
+    if (std::error_code ec = oldOrError.getError()) {
+        llvm::errs() << argv[1] << ": " << ec.message() << "\n";
+        return 1;
+    }
+    auto patchOrError = llvm::MemoryBuffer::getFile(argv[2]);
+    if (std::error_code ec = patchOrError.getError()) {
+        llvm::errs() << argv[2] << ": " << ec.message() << "\n";
+        return 1;
+    }
+
+    auto newOrError = applyPatch((*oldOrError)->getBuffer(), (*patchOrError)->getBuffer());
+    if (std::error_code ec = newOrError.getError()) {
+        llvm::errs() << argv[2] << ": " << ec.message() << "\n";
+        return 1;
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream os(argv[3], ec);
+    if (!ec) {
+        os << *newOrError;
+        os.close();
+        ec = os.error();
+    }
+    if (ec) {
+        llvm::errs() << argv[3] << ": " << ec.message() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+std::string getDefaultGraphDatabasePath()
+{
+    llvm::SmallString<256> databasePath;
+    if (!llvm::sys::path::cache_directory(databasePath))
+        return std::string();
+    llvm::sys::path::append(databasePath, "dll-bundler", "graph");
+    return std::string(databasePath.str());
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::object::COFFObjectFile>> openCOFFObject(llvm::MemoryBufferRef mb)
+{
+#if LLVM_VERSION_MAJOR >= 11
+    return llvm::expectedToErrorOr(llvm::object::COFFObjectFile::create(mb));
+#else
+    std::error_code ec;
+    std::unique_ptr<llvm::object::COFFObjectFile> obj(new llvm::object::COFFObjectFile(mb, ec));
+    if (ec)
+        return ec;
+    return obj;
+#endif
+}
+
+llvm::ErrorOr<std::vector<DllImport>> getDllImports(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, ImageInfo *fileInfo)
+{
+    TRACE_PROBE1(get_imports__start, TRACE_STR(filePath));
+
+    auto sourceOrError = fs.getBufferForFile(filePath);
+    if (std::error_code ec = sourceOrError.getError()) {
+        TRACE_PROBE3(get_imports__done, TRACE_STR(filePath), 0, -1);
+        return ec;
+    }
+
+    auto objOrError = llvm::expectedToErrorOr(llvm::object::ObjectFile::createObjectFile(**sourceOrError));
+    if (std::error_code ec = objOrError.getError()) {
+        TRACE_PROBE3(get_imports__done, TRACE_STR(filePath), (*sourceOrError)->getBufferSize(), -1);
+        return ec;
+    }
+
+    llvm::object::ObjectFile &obj = **objOrError;
+    std::vector<std::string> *runPaths = fileInfo ? &fileInfo->runPaths : nullptr;
+    std::vector<FileRange> *readRanges = (fileInfo && fileInfo->keepReadRanges) ? &fileInfo->readRanges : nullptr;
+    llvm::ErrorOr<std::vector<DllImport>> importsOrError = std::make_error_code(std::errc::executable_format_error);
+
+    if (fileInfo) {
+        fileInfo->arch = obj.getArch();
+        fileInfo->format = obj.isCOFF() ? ImageFormat::PE : ImageFormat::ELF;
+        fileInfo->fileSize = (*sourceOrError)->getBufferSize();
+    }
+    addHeaderRanges(obj, readRanges);
+
+    if (const auto *coff = llvm::dyn_cast<llvm::object::COFFObjectFile>(&obj)) {
+        importsOrError = getCOFFImports(*coff, readRanges);
+        if (fileInfo && fileInfo->scanDllNames)
+            fileInfo->dllNames = getCOFFDllNames(*coff, readRanges);
+    }
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(&obj))
+        importsOrError = getELFImports(getELFFile(*elf), filePath, runPaths, readRanges);
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF32BEObjectFile>(&obj))
+        importsOrError = getELFImports(getELFFile(*elf), filePath, runPaths, readRanges);
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(&obj))
+        importsOrError = getELFImports(getELFFile(*elf), filePath, runPaths, readRanges);
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF64BEObjectFile>(&obj))
+        importsOrError = getELFImports(getELFFile(*elf), filePath, runPaths, readRanges);
+
+    TRACE_PROBE3(get_imports__done, TRACE_STR(filePath), (*sourceOrError)->getBufferSize(),
+                 importsOrError ? int64_t(importsOrError->size()) : int64_t(-1));
+    return importsOrError;
+}
+
+std::vector<std::string> getCOFFDllNames(const llvm::object::COFFObjectFile &obj, std::vector<FileRange> *readRanges)
+{
+    // the names passed to LoadLibrary are constants, which live among the
+    // initialized data that is neither written nor executed
+    const uint32_t mask = llvm::COFF::IMAGE_SCN_CNT_INITIALIZED_DATA | llvm::COFF::IMAGE_SCN_MEM_WRITE | llvm::COFF::IMAGE_SCN_MEM_EXECUTE;
+    llvm::StringSet<> names;
+    for (const llvm::object::SectionRef &sectionRef : obj.sections()) {
+        const llvm::object::coff_section *section = obj.getCOFFSection(sectionRef);
+        llvm::ArrayRef<uint8_t> contents;
+        if ((section->Characteristics & mask) != llvm::COFF::IMAGE_SCN_CNT_INITIALIZED_DATA ||
+            failed(obj.getSectionContents(section, contents)))
+            continue;
+        addReadRange(readRanges, obj.getData(), contents.data(), contents.size());
+        scanDllNames(llvm::toStringRef(contents), names);
+    }
+
+    std::vector<std::string> sortedNames;
+    for (const auto &item : names)
+        sortedNames.push_back(item.getKey().str());
+    std::sort(sortedNames.begin(), sortedNames.end());
+    return sortedNames;
+}
+
+// finds ".dll" followed by the end of an ASCII or a UTF-16 string, then goes
+// back to the start of the file name; memchr runs vectorized, and dots are
+// few enough in data for the candidates to cost little
+void scanDllNames(llvm::StringRef data, llvm::StringSet<> &names)
+{
+    const char *begin = data.begin();
+    const char *end = data.end();
+    auto isChar = [](const char *p, char c) { return (*p | 0x20) == c; };
+
+    for (const char *dot = begin; (dot = static_cast<const char *>(std::memchr(dot, '.', end - dot))); ++dot) {
+        size_t left = end - dot;
+        if (left >= 5 && isChar(dot + 1, 'd') && isChar(dot + 2, 'l') && isChar(dot + 3, 'l') && dot[4] == '\0') {
+            const char *start = dot;
+            while (start > begin && isFileNameChar(start[-1]))
+                --start;
+            if (start < dot)
+                names.insert(llvm::StringRef(start, dot + 4 - start).lower());
+        }
+        else if (left >= 10 && dot[1] == '\0' && isChar(dot + 2, 'd') && dot[3] == '\0' && isChar(dot + 4, 'l') &&
+                 dot[5] == '\0' && isChar(dot + 6, 'l') && dot[7] == '\0' && dot[8] == '\0' && dot[9] == '\0') {
+            // back one code unit at a time while they are name characters,
+            // taking the wide reading when the high byte is zero; the zero
+            // ending an ASCII string just before reads the same, so when the
+            // byte before the first unit is a name character, the name
+            // without that unit goes in as well, the search paths telling
+            const char *start = dot;
+            while (start - begin >= 2 && start[-1] == '\0' && isFileNameChar(start[-2]))
+                start -= 2;
+            if (start == dot)
+                continue;
+            std::string name;
+            for (const char *p = start; p < dot + 8; p += 2)
+                name += llvm::toLower(*p);
+            if (start > begin && isFileNameChar(start[-1]) && name.size() > 5)
+                names.insert(name.substr(1));
+            names.insert(name);
+        }
+    }
+}
+
+// path separators end a name, as the DLLs are looked for by file name
+bool isFileNameChar(char c)
+{
+    return llvm::isAlnum(c) || c == '_' || c == '-' || c == '.' || c == '+' || c == '~' || c == '$';
+}
+
+std::vector<DllImport> getCOFFImports(const llvm::object::COFFObjectFile &obj, std::vector<FileRange> *readRanges)
+{
+    std::vector<DllImport> imports;
+
+    // what is read below past the headers: the import directories, and the
+    // names and thunk tables they point to
+    llvm::StringRef file = obj.getData();
+    auto addRvaRange = [&](uint32_t rva, uint64_t size) {
+        uintptr_t ptr = 0;
+        if (rva != 0 && !failed(obj.getRvaPtr(rva, ptr)))
+            addReadRange(readRanges, file, reinterpret_cast<const void *>(ptr), size);
+    };
+    uint64_t thunkSize = obj.getBytesInAddress();
+    if (readRanges) {
+        if (const llvm::object::data_directory *dir = getDataDirectory(obj, llvm::COFF::IMPORT_TABLE))
+            addRvaRange(dir->RelativeVirtualAddress, dir->Size);
+        if (const llvm::object::data_directory *dir = getDataDirectory(obj, llvm::COFF::DELAY_IMPORT_DESCRIPTOR))
+            addRvaRange(dir->RelativeVirtualAddress, dir->Size);
+    }
+
+    for (auto &dir : obj.import_directories()) {
+        llvm::StringRef name;
+        auto ec = dir.getName(name);
+        if (ec) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = obj.getFileName();
+            event.message = getErrorMessage(std::move(ec));
+            logger.write(event);
+        }
+        else {
+            DllImport import;
+            import.name = name.lower();
+            for (auto &sym : dir.imported_symbols()) {
+                (void)sym;
+                ++import.functionCount;
+            }
+            const llvm::object::coff_import_directory_table_entry *entry = nullptr;
+            if (readRanges && !failed(dir.getImportTableEntry(entry))) {
+                // the entry ending the directory, and the null thunks
+                addReadRange(readRanges, file, entry + 1, sizeof(*entry));
+                addReadRange(readRanges, file, name.data(), name.size() + 1);
+                addRvaRange(entry->ImportLookupTableRVA, (import.functionCount + 1) * thunkSize);
+                addRvaRange(entry->ImportAddressTableRVA, (import.functionCount + 1) * thunkSize);
+            }
+            imports.push_back(std::move(import));
+        }
+    }
+
+    for (auto &dir : obj.delay_import_directories()) {
+        llvm::StringRef name;
+        auto ec = dir.getName(name);
+        if (ec) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = obj.getFileName();
+            event.message = getErrorMessage(std::move(ec));
+            logger.write(event);
+        }
+        else {
+            DllImport import;
+            import.name = name.lower();
+            import.delayLoaded = true;
+            for (auto &sym : dir.imported_symbols()) {
+                (void)sym;
+                ++import.functionCount;
+            }
+            const llvm::object::delay_import_directory_table_entry *entry = nullptr;
+            if (readRanges && !failed(dir.getDelayImportTable(entry))) {
+                addReadRange(readRanges, file, name.data(), name.size() + 1);
+                addRvaRange(entry->DelayImportNameTable, (import.functionCount + 1) * thunkSize);
+            }
+            imports.push_back(std::move(import));
+        }
+    }
+
+    return imports;
+}
+
+template <class ELFT>
+std::vector<DllImport> getELFImports(const llvm::object::ELFFile<ELFT> &elf, llvm::StringRef filePath, std::vector<std::string> *runPaths, std::vector<FileRange> *readRanges)
+{
+    std::vector<DllImport> imports;
+
+    // what is read below past the headers: the dynamic entries, and the
+    // strings they name
+    llvm::StringRef file(reinterpret_cast<const char *>(elf.base()), elf.getBufSize());
+
+    auto dynamicOrError = elf.dynamicEntries();
+    if (!dynamicOrError) {
+        // statically linked
+        llvm::consumeError(dynamicOrError.takeError());
+        return imports;
+    }
+    addReadRange(readRanges, file, dynamicOrError->data(), dynamicOrError->size() * sizeof(typename ELFT::Dyn));
+
+    uint64_t stringTableAddress = 0;
+    uint64_t stringTableSize = 0;
+    std::vector<uint64_t> needed;
+    std::vector<uint64_t> runPathEntries;
+    std::vector<uint64_t> rpathEntries;
+
+    for (const auto &dyn : *dynamicOrError) {
+        switch (dyn.getTag()) {
+        case llvm::ELF::DT_STRTAB:
+            stringTableAddress = dyn.getPtr();
+            break;
+        case llvm::ELF::DT_STRSZ:
+            stringTableSize = dyn.getVal();
+            break;
+        case llvm::ELF::DT_NEEDED:
+            needed.push_back(dyn.getVal());
+            break;
+        case llvm::ELF::DT_RUNPATH:
+            runPathEntries.push_back(dyn.getVal());
+            break;
+        case llvm::ELF::DT_RPATH:
+            rpathEntries.push_back(dyn.getVal());
+            break;
+        }
+    }
+
+    auto stringTableOrError = elf.toMappedAddr(stringTableAddress);
+    if (!stringTableOrError) {
+        llvm::consumeError(stringTableOrError.takeError());
+        return imports;
+    }
+
+    const uint8_t *bufferEnd = elf.base() + elf.getBufSize();
+    llvm::StringRef stringTable(reinterpret_cast<const char *>(*stringTableOrError),
+                                std::min<uint64_t>(stringTableSize, bufferEnd - *stringTableOrError));
+    auto getString = [&](uint64_t offset) -> llvm::StringRef {
+        if (offset >= stringTable.size())
+            return llvm::StringRef();
+        llvm::StringRef str = stringTable.drop_front(offset);
+        str = str.take_until([](char c) { return c == '\0'; });
+        addReadRange(readRanges, file, str.data(), str.size() + 1);
+        return str;
+    };
+
+    for (uint64_t offset : needed) {
+        DllImport import;
+        import.name = std::string(getString(offset));
+        if (!import.name.empty())
+            imports.push_back(std::move(import));
+    }
+
+    // RUNPATH takes precedence over RPATH, which is then ignored
+    if (runPaths) {
+        llvm::StringRef origin = llvm::sys::path::parent_path(filePath);
+        for (uint64_t offset : runPathEntries.empty() ? rpathEntries : runPathEntries) {
+            llvm::SmallVector<llvm::StringRef, 8> dirs;
+            getString(offset).split(dirs, ':', -1, false);
+            for (llvm::StringRef dir : dirs) {
+                std::string expanded;
+                if (dir.consume_front("$ORIGIN") || dir.consume_front("${ORIGIN}"))
+                    expanded = (origin.empty() ? llvm::StringRef(".") : origin).str();
+                expanded.append(dir.begin(), dir.end());
+                runPaths->push_back(std::move(expanded));
+            }
+        }
+    }
+
+    return imports;
+}
+
+template <class ELFT>
+const llvm::object::ELFFile<ELFT> &getELFFile(const llvm::object::ELFObjectFile<ELFT> &obj)
+{
+#if LLVM_VERSION_MAJOR >= 12
+    return obj.getELFFile();
+#else
+    return *obj.getELFFile();
+#endif
+}
+
+// the headers which opening the file reads: up to the section table of a
+// PE, the file, program and section headers of an ELF
+void addHeaderRanges(const llvm::object::ObjectFile &obj, std::vector<FileRange> *readRanges)
+{
+    if (!readRanges)
+        return;
+    llvm::StringRef file = obj.getData();
+    if (const auto *coff = llvm::dyn_cast<llvm::object::COFFObjectFile>(&obj)) {
+        if (const llvm::object::coff_file_header *header = coff->getCOFFHeader()) {
+            const char *sectionTableEnd = reinterpret_cast<const char *>(header + 1) + header->SizeOfOptionalHeader +
+                uint64_t(header->NumberOfSections) * sizeof(llvm::object::coff_section);
+            addReadRange(readRanges, file, file.data(), sectionTableEnd - file.data());
+        }
+    }
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF32LEObjectFile>(&obj))
+        addELFHeaderRanges(getELFFile(*elf), readRanges);
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF32BEObjectFile>(&obj))
+        addELFHeaderRanges(getELFFile(*elf), readRanges);
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF64LEObjectFile>(&obj))
+        addELFHeaderRanges(getELFFile(*elf), readRanges);
+    else if (const auto *elf = llvm::dyn_cast<llvm::object::ELF64BEObjectFile>(&obj))
+        addELFHeaderRanges(getELFFile(*elf), readRanges);
+}
+
+template <class ELFT>
+void addELFHeaderRanges(const llvm::object::ELFFile<ELFT> &elf, std::vector<FileRange> *readRanges)
+{
+    llvm::StringRef file(reinterpret_cast<const char *>(elf.base()), elf.getBufSize());
+    addReadRange(readRanges, file, file.data(), sizeof(typename ELFT::Ehdr));
+    if (auto headersOrError = elf.program_headers())
+        addReadRange(readRanges, file, headersOrError->data(), headersOrError->size() * sizeof(typename ELFT::Phdr));
+    else
+        llvm::consumeError(headersOrError.takeError());
+    if (auto sectionsOrError = elf.sections())
+        addReadRange(readRanges, file, sectionsOrError->data(), sectionsOrError->size() * sizeof(typename ELFT::Shdr));
+    else
+        llvm::consumeError(sectionsOrError.takeError());
+}
+
+// keeps a copy of what the parser read, as much of it as is in the file
+void addReadRange(std::vector<FileRange> *readRanges, llvm::StringRef file, const void *begin, uint64_t size)
+{
+    const char *p = static_cast<const char *>(begin);
+    if (!readRanges || p < file.begin() || p >= file.end())
+        return;
+    uint64_t offset = p - file.begin();
+    readRanges->push_back({offset, file.substr(offset, size).str()});
+}
+
+std::string findImport(llvm::vfs::FileSystem &fs, llvm::StringRef dllImport, ImageFormat dllFormat, llvm::Triple::ArchType dllArch, const std::vector<std::string> &searchPaths, size_t *searchPathIndex, RecordingFileSystem *recordingFs)
+{
+    TRACE_PROBE1(find_import__start, TRACE_STR(dllImport));
+
+    for (size_t i = 0; i < searchPaths.size(); ++i) {
+        llvm::StringRef dir = searchPaths[i];
+        std::error_code ec;
+        llvm::vfs::directory_iterator it = fs.dir_begin(dir, ec);
+        if (ec)
+            continue;
+        while (it != llvm::vfs::directory_iterator()) {
+            const llvm::vfs::directory_entry &ent = *it;
+            llvm::StringRef filePath = ent.path();
+            llvm::StringRef fileName = llvm::sys::path::filename(filePath);
+#if LLVM_VERSION_MAJOR >= 13
+            bool fileNameEqual = fileName.equals_insensitive(dllImport);
+#else
+            bool fileNameEqual = fileName.equals_lower(dllImport);
+#endif
+            if (dllFormat == ImageFormat::ELF)
+                fileNameEqual = fileName == dllImport;
+            if (fileNameEqual) {
+                // a recording needs what the check read, in case the file is
+                // skipped and so never parsed
+                ImageInfo info;
+                info.keepReadRanges = recordingFs != nullptr;
+                bool match = checkFileArchitecture(fs, filePath, dllFormat, dllArch, &info);
+                if (recordingFs && !info.readRanges.empty())
+                    recordingFs->recordRanges(filePath, info.fileSize, std::move(info.readRanges));
+                if (!match) {
+                    LogEvent event(LogLevel::Info, "skip");
+                    event.name = dllImport;
+                    event.path = filePath;
+                    logger.write(event);
+                }
+                else {
+                    if (searchPathIndex)
+                        *searchPathIndex = i;
+                    TRACE_PROBE2(find_import__done, TRACE_STR(dllImport), TRACE_STR(filePath));
+                    return std::string(filePath);
+                }
+            }
+            it.increment(ec);
+            if (ec)
+                break;
+        }
+    }
+    TRACE_PROBE2(find_import__done, TRACE_STR(dllImport), "");
+    return std::string();
+}
+
+bool checkFileArchitecture(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, ImageFormat dllFormat, llvm::Triple::ArchType dllArch, ImageInfo *fileInfo)
+{
+    TRACE_PROBE1(check_arch__start, TRACE_STR(filePath));
+
+    bool match = false;
+    auto sourceOrError = fs.getBufferForFile(filePath);
+    if (sourceOrError) {
+        auto objOrError = llvm::expectedToErrorOr(llvm::object::ObjectFile::createObjectFile(**sourceOrError));
+        if (objOrError) {
+            llvm::object::ObjectFile &obj = **objOrError;
+            ImageFormat format = obj.isCOFF() ? ImageFormat::PE : ImageFormat::ELF;
+            match = (obj.isCOFF() || obj.isELF()) && format == dllFormat && obj.getArch() == dllArch;
+            if (fileInfo && fileInfo->keepReadRanges) {
+                fileInfo->fileSize = (*sourceOrError)->getBufferSize();
+                addHeaderRanges(obj, &fileInfo->readRanges);
+            }
+        }
+    }
+
+    TRACE_PROBE2(check_arch__done, TRACE_STR(filePath), int(match));
+    return match;
+}
+
+std::error_code writeFile(llvm::StringRef filePath, llvm::StringRef contents)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(filePath, ec);
+    if (ec)
+        return ec;
+
+    os << contents;
+    os.close();
+    return os.error();
+}
+
+std::error_code cloneFile(llvm::StringRef from, llvm::StringRef to)
+{
+#if defined(FICLONE)
+    llvm::SmallString<256> fromPath(from);
+    int fromFd = ::open(fromPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fromFd == -1)
+        return std::error_code(errno, std::generic_category());
+
+    llvm::SmallString<256> toPath(to);
+    int toFd = ::open(toPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (toFd == -1) {
+        std::error_code ec(errno, std::generic_category());
+        ::close(fromFd);
+        return ec;
+    }
+
+    // the file then shares the extents of the other until either is written
+    std::error_code ec;
+    if (::ioctl(toFd, FICLONE, fromFd) == -1)
+        ec = std::error_code(errno, std::generic_category());
+
+    ::close(fromFd);
+    if (::close(toFd) == -1 && !ec)
+        ec = std::error_code(errno, std::generic_category());
+    return ec;
+#else
+    (void)from;
+    (void)to;
+    return std::make_error_code(std::errc::not_supported);
+#endif
+}
+
+std::error_code copyFileDirect(llvm::vfs::FileSystem &fs, llvm::StringRef from, llvm::StringRef to)
+{
+#if defined(O_DIRECT)
+    llvm::SmallString<256> realPath;
+    if (std::error_code ec = fs.getRealPath(from, realPath))
+        return ec;
+
+    int fromFd = ::open(realPath.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT);
+    if (fromFd == -1)
+        return std::error_code(errno, std::generic_category());
+
+    llvm::SmallString<256> toPath(to);
+    int toFd = ::open(toPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+    if (toFd == -1) {
+        std::error_code ec(errno, std::generic_category());
+        ::close(fromFd);
+        return ec;
+    }
+
+    void *buffer = nullptr;
+    std::error_code ec;
+    if (::posix_memalign(&buffer, directIoAlignment, directIoBufferSize) != 0)
+        ec = std::make_error_code(std::errc::not_enough_memory);
+
+    // the final block comes short of the alignment, write it padded and
+    // truncate the file back to the size of the source
+    uint64_t size = 0;
+    while (!ec) {
+        ssize_t count = ::read(fromFd, buffer, directIoBufferSize);
+        if (count == -1) {
+            if (errno != EINTR)
+                ec = std::error_code(errno, std::generic_category());
+            continue;
+        }
+        if (count == 0)
+            break;
+        size_t padded = (size_t(count) + directIoAlignment - 1) & ~(directIoAlignment - 1);
+        std::memset(static_cast<char *>(buffer) + count, 0, padded - size_t(count));
+        for (size_t written = 0; !ec && written < padded;) {
+            ssize_t n = ::write(toFd, static_cast<char *>(buffer) + written, padded - written);
+            if (n == -1 && errno != EINTR)
+                ec = std::error_code(errno, std::generic_category());
+            else if (n > 0)
+                written += size_t(n);
+        }
+        size += uint64_t(count);
+    }
+
+    if (!ec && ::ftruncate(toFd, off_t(size)) == -1)
+        ec = std::error_code(errno, std::generic_category());
+
+    std::free(buffer);
+    ::close(fromFd);
+    if (::close(toFd) == -1 && !ec)
+        ec = std::error_code(errno, std::generic_category());
+    return ec;
+#else
+    (void)fs;
+    (void)from;
+    (void)to;
+    return std::make_error_code(std::errc::not_supported);
+#endif
+}
+
+void runCopier(llvm::vfs::FileSystem &fs, CopyQueue &queue, const CopyOptions &options)
+{
+    for (CopyJob job; queue.pop(job);) {
+        if (options.concurrency)
+            options.concurrency->acquire();
+        std::chrono::steady_clock::time_point jobStart = std::chrono::steady_clock::now();
+
+        std::vector<std::string> destinations(1, job.to);
+        destinations.insert(destinations.end(), job.otherDestinations.begin(), job.otherDestinations.end());
+
+        llvm::ErrorOr<uint64_t> hashOrError = std::make_error_code(std::errc::not_supported);
+        if (options.hashCache) {
+            hashOrError = options.hashCache->getFileHash(fs, job.from);
+            for (size_t i = 0; hashOrError && i < destinations.size();) {
+                auto destinationStatus = fs.status(destinations[i]);
+                llvm::ErrorOr<uint64_t> destinationHash = std::make_error_code(std::errc::not_supported);
+                if (destinationStatus && destinationStatus->getSize() == job.size)
+                    destinationHash = options.hashCache->getFileHash(fs, destinations[i]);
+                if (!destinationHash || *destinationHash != *hashOrError) {
+                    ++i;
+                    continue;
+                }
+                LogEvent event(LogLevel::Info, "unchanged");
+                event.path = destinations[i];
+                logger.write(event);
+                destinations.erase(destinations.begin() + i);
+            }
+            if (destinations.empty()) {
+                if (options.concurrency)
+                    options.concurrency->cancel();
+                continue;
+            }
+        }
+
+        // the destination still holds the previous version until the copy
+        if (job.hasPatchBase && destinations[0] == job.to)
+            writePatch(fs, job, options.patchDir);
+
+        // the source is read once at most: the first destination gets a copy,
+        // and the others a clone of it on file systems sharing extents, or
+        // else the contents already read
+        std::unique_ptr<llvm::MemoryBuffer> contents;
+        std::error_code readError;
+        std::error_code firstError;
+        for (size_t i = 0; i < destinations.size(); ++i) {
+            const std::string &to = destinations[i];
+            std::error_code ec;
+            bool copied = false;
+
+            std::chrono::steady_clock::time_point copyStart = std::chrono::steady_clock::now();
+            TRACE_PROBE3(copy__start, TRACE_STR(job.from), TRACE_STR(to), job.size);
+            if (i == 0 && options.directIoThreshold != 0 && job.size >= options.directIoThreshold) {
+                // file systems without O_DIRECT support reject it on open,
+                // those files get the regular copy
+                ec = copyFileDirect(fs, job.from, to);
+                copied = (ec != std::errc::invalid_argument && ec != std::errc::not_supported);
+            }
+            else if (i > 0 && !firstError)
+                copied = !cloneFile(destinations[0], to);
+            if (!copied) {
+                if (!contents && !readError) {
+                    auto bufferOrError = fs.getBufferForFile(job.from, -1, false);
+                    readError = bufferOrError.getError();
+                    if (!readError)
+                        contents = std::move(*bufferOrError);
+                }
+                ec = contents ? writeFile(to, contents->getBuffer()) : readError;
+            }
+            if (i == 0)
+                firstError = ec;
+            TRACE_PROBE4(copy__done, TRACE_STR(job.from), TRACE_STR(to), job.size, ec.value());
+            if (!ec && hashOrError)
+                options.hashCache->setFileHash(fs, to, *hashOrError);
+            if (options.journal) {
+                if (ec)
+                    options.journal->addFailure();
+                else
+                    options.journal->addCopy(fs, job.from, to);
+            }
+
+            LogEvent event(LogLevel::Info, "copy");
+            event.path = job.from;
+            event.destination = to;
+            event.bytes = job.size;
+            event.duration = getMicroseconds(copyStart);
+            logger.write(event);
+            if (ec) {
+                LogEvent event(LogLevel::Error, "error");
+                event.path = to;
+                event.message = ec.message();
+                logger.write(event);
+            }
+        }
+        if (options.fileAdvice)
+            adviseFile(fs, job.from, FileAdvice::DontNeed);
+        if (options.concurrency)
+            options.concurrency->release(job.size * destinations.size(), getMicroseconds(jobStart));
+    }
+}
+
+void adviseFile(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, FileAdvice advice)
+{
+#if defined(POSIX_FADV_WILLNEED)
+    // hints are best effort, failures are not worth reporting
+    llvm::SmallString<256> realPath;
+    if (fs.getRealPath(filePath, realPath))
+        return;
+
+    int fd = ::open(realPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    int posixAdvice = (advice == FileAdvice::WillNeed) ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+    ::posix_fadvise(fd, 0, 0, posixAdvice);
+    ::close(fd);
+#else
+    (void)fs;
+    (void)filePath;
+    (void)advice;
+#endif
+}
+
+llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> loadInMemory(llvm::vfs::FileSystem &fs, const std::vector<std::string> &searchPaths, const std::vector<std::string> &rootBinaryFiles)
+{
+    llvm::IntrusiveRefCntPtr<llvm::vfs::InMemoryFileSystem> memoryFs(new llvm::vfs::InMemoryFileSystem);
+    if (auto cwd = fs.getCurrentWorkingDirectory())
+        memoryFs->setCurrentWorkingDirectory(*cwd);
+
+    auto addFile = [&fs, &memoryFs](llvm::StringRef filePath) {
+        // volatile, so the contents are read rather than mapped from disk
+        auto bufferOrError = fs.getBufferForFile(filePath, -1, false, true);
+        if (!bufferOrError.getError())
+            memoryFs->addFile(filePath, 0, std::move(*bufferOrError));
+    };
+
+    for (const std::string &rootBinaryFile : rootBinaryFiles)
+        addFile(rootBinaryFile);
+
+    for (llvm::StringRef dir : searchPaths) {
+        std::error_code ec;
+        for (llvm::vfs::directory_iterator it = fs.dir_begin(dir, ec);
+             !ec && it != llvm::vfs::directory_iterator(); it.increment(ec)) {
+            if (it->type() != llvm::sys::fs::file_type::directory_file)
+                addFile(it->path());
+        }
+    }
+
+    return memoryFs;
+}
+
+llvm::ErrorOr<LoadCost> getLoadCost(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, ImageHeader *imageHeader)
+{
+    LoadCost cost;
+
+    auto sourceOrError = fs.getBufferForFile(filePath);
+    if (std::error_code ec = sourceOrError.getError())
+        return ec;
+
+    auto objOrError = openCOFFObject(**sourceOrError);
+    if (std::error_code ec = objOrError.getError())
+        return ec;
+
+    llvm::object::COFFObjectFile &obj = **objOrError;
+
+    for (auto &dir : obj.import_directories()) {
+        for (auto &sym : dir.imported_symbols()) {
+            (void)sym;
+            ++cost.importedFunctions;
+        }
+    }
+
+    for (auto &dir : obj.delay_import_directories()) {
+        for (auto &sym : dir.imported_symbols()) {
+            (void)sym;
+            ++cost.delayImportedFunctions;
+        }
+    }
+
+    // the ABSOLUTE entries only pad blocks to 32-bit boundaries
+    for (auto &reloc : obj.base_relocs()) {
+        uint8_t type;
+        if (!failed(reloc.getType(type)) && type != llvm::COFF::IMAGE_REL_BASED_ABSOLUTE)
+            ++cost.baseRelocations;
+    }
+
+    const llvm::object::data_directory *relocDir = getDataDirectory(obj, llvm::COFF::BASE_RELOCATION_TABLE);
+    if (relocDir)
+        cost.relocationBytes = relocDir->Size;
+
+    ImageHeader header = getImageHeader(obj);
+    cost.sections = obj.getNumberOfSections();
+    cost.mappedSize = header.sizeOfImage;
+
+    if (imageHeader)
+        *imageHeader = header;
+
+    // the TLS directory holds the VA of a null-terminated array of callback VAs
+    const llvm::object::data_directory *tlsDir = getDataDirectory(obj, llvm::COFF::TLS_TABLE);
+    if (tlsDir && tlsDir->RelativeVirtualAddress != 0) {
+        unsigned ptrSize = obj.is64() ? 8 : 4;
+        uint32_t tlsSize = obj.is64() ? sizeof(llvm::object::coff_tls_directory64) : sizeof(llvm::object::coff_tls_directory32);
+        llvm::ArrayRef<uint8_t> tlsBytes;
+        uint64_t callbacksVA = 0;
+        if (!failed(obj.getRvaAndSizeAsBytes(tlsDir->RelativeVirtualAddress, tlsSize, tlsBytes))) {
+            if (obj.is64())
+                callbacksVA = reinterpret_cast<const llvm::object::coff_tls_directory64 *>(tlsBytes.data())->AddressOfCallBacks;
+            else
+                callbacksVA = reinterpret_cast<const llvm::object::coff_tls_directory32 *>(tlsBytes.data())->AddressOfCallBacks;
+        }
+        if (callbacksVA > header.imageBase) {
+            uint64_t rva = callbacksVA - header.imageBase;
+            for (llvm::ArrayRef<uint8_t> entry; rva <= UINT32_MAX; rva += ptrSize) {
+                if (failed(obj.getRvaAndSizeAsBytes(uint32_t(rva), ptrSize, entry)))
+                    break;
+                uint64_t callback = (ptrSize == 8) ?
+                    uint64_t(llvm::support::endian::read64le(entry.data())) :
+                    uint64_t(llvm::support::endian::read32le(entry.data()));
+                if (callback == 0)
+                    break;
+                ++cost.tlsCallbacks;
+            }
+        }
+    }
+
+    return cost;
+}
+
+void printLoadReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved)
+{
+    llvm::raw_ostream &os = llvm::outs();
+
+    llvm::StringMap<size_t> index;
+    for (size_t i = 0; i < resolved.size(); ++i)
+        index.insert({resolved[i].name, i});
+
+    // rows follow the order in which the loader maps the DLLs, and the
+    // running column is what it has mapped once each row is loaded; the
+    // totals of the static load, from the root, leave out the delay-loaded
+    // DLLs, which are only mapped when first called and come separately
+    std::vector<bool> initialLoad = getStaticallyLoaded(resolved, index, size_t(-1));
+    std::vector<size_t> order = getLoadOrder(resolved);
+
+    for (bool delayed : {false, true}) {
+        LoadCost total;
+        bool any = false;
+        for (size_t i : order) {
+            if (initialLoad[i] == delayed)
+                continue;
+            if (!any) {
+                os << (delayed ? "\nDelay-loaded DLL                 " : "DLL                              ")
+                   << " Imports  Delayed   Relocs   TLS Sects       Mapped      Running\n";
+                any = true;
+            }
+
+            const ResolvedDll &dll = resolved[i];
+            auto costOrError = getLoadCost(fs, dll.fullPath);
+            if (std::error_code ec = costOrError.getError()) {
+                LogEvent event(LogLevel::Error, "error");
+                event.path = dll.fullPath;
+                event.message = ec.message();
+                logger.write(event);
+                continue;
+            }
+            const LoadCost &cost = *costOrError;
+            total.importedFunctions += cost.importedFunctions;
+            total.delayImportedFunctions += cost.delayImportedFunctions;
+            total.baseRelocations += cost.baseRelocations;
+            total.tlsCallbacks += cost.tlsCallbacks;
+            total.sections += cost.sections;
+            total.mappedSize += cost.mappedSize;
+            os << llvm::format("%-32s %8llu %8llu %8llu %5llu %5llu %12llu %12llu\n",
+                               dll.name.c_str(),
+                               (unsigned long long)cost.importedFunctions,
+                               (unsigned long long)cost.delayImportedFunctions,
+                               (unsigned long long)cost.baseRelocations,
+                               (unsigned long long)cost.tlsCallbacks,
+                               (unsigned long long)cost.sections,
+                               (unsigned long long)cost.mappedSize,
+                               (unsigned long long)total.mappedSize);
+        }
+
+        if (any) {
+            os << llvm::format("%-32s %8llu %8llu %8llu %5llu %5llu %12llu\n",
+                               delayed ? "(delay-loaded total)" : "(total)",
+                               (unsigned long long)total.importedFunctions,
+                               (unsigned long long)total.delayImportedFunctions,
+                               (unsigned long long)total.baseRelocations,
+                               (unsigned long long)total.tlsCallbacks,
+                               (unsigned long long)total.sections,
+                               (unsigned long long)total.mappedSize);
+        }
+    }
+}
+
+void printDelayLoadReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved)
+{
+    llvm::raw_ostream &os = llvm::outs();
+
+    llvm::StringMap<size_t> index;
+    for (size_t i = 0; i < resolved.size(); ++i)
+        index.insert({resolved[i].name, i});
+
+    std::vector<uint64_t> mappedSizes(resolved.size());
+    for (size_t i = 0; i < resolved.size(); ++i) {
+        auto costOrError = getLoadCost(fs, resolved[i].fullPath);
+        if (!costOrError.getError())
+            mappedSizes[i] = costOrError->mappedSize;
+    }
+
+    struct Candidate {
+        size_t dll;
+        uint32_t functions;
+        uint32_t importers;
+        size_t savedDlls;
+        uint64_t savedBytes;
+    };
+
+    std::vector<bool> initialLoad = getStaticallyLoaded(resolved, index, size_t(-1));
+    std::vector<Candidate> candidates;
+
+    for (size_t i = 0; i < resolved.size(); ++i) {
+        if (resolved[i].root || !initialLoad[i])
+            continue;
+
+        Candidate candidate{i, 0, 0, 0, 0};
+        for (const ResolvedDll &importer : resolved) {
+            for (const DllImport &import : importer.imports) {
+                if (!import.delayLoaded && import.name == resolved[i].name) {
+                    candidate.functions += import.functionCount;
+                    ++candidate.importers;
+                }
+            }
+        }
+
+        // what leaves the initial load if every static import of this DLL
+        // were turned into a delay import
+        std::vector<bool> remaining = getStaticallyLoaded(resolved, index, i);
+        for (size_t j = 0; j < resolved.size(); ++j) {
+            if (initialLoad[j] && !remaining[j]) {
+                ++candidate.savedDlls;
+                candidate.savedBytes += mappedSizes[j];
+            }
+        }
+
+        if (candidate.functions <= delayCandidateMaxFunctions || candidate.savedDlls >= delayCandidateMinSavedDlls)
+            candidates.push_back(candidate);
+    }
+
+    std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+        return a.savedBytes > b.savedBytes;
+    });
+
+    os << "Delay-load candidate             Functions Importers Saved DLLs  Saved bytes\n";
+
+    for (const Candidate &candidate : candidates) {
+        os << llvm::format("%-32s %9u %9u %10llu %12llu\n",
+                           resolved[candidate.dll].name.c_str(),
+                           candidate.functions,
+                           candidate.importers,
+                           (unsigned long long)candidate.savedDlls,
+                           (unsigned long long)candidate.savedBytes);
+    }
+}
+
+void printBaseAddressReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved)
+{
+    llvm::raw_ostream &os = llvm::outs();
+
+    struct Image {
+        size_t dll;
+        ImageHeader header;
+        LoadCost cost;
+        bool relocated = false;
+        std::vector<size_t> overlaps;
+    };
+
+    llvm::StringMap<size_t> index;
+    for (size_t i = 0; i < resolved.size(); ++i)
+        index.insert({resolved[i].name, i});
+
+    // each executable is a process of its own, whose ranges do not compete
+    // with the others', so the first one stands for them all; only the DLLs
+    // it loads at startup compete, the delay-loaded ones come later, and go
+    // wherever the address space is still free
+    std::vector<bool> startupLoad(resolved.size());
+    std::queue<size_t> toVisit;
+    startupLoad[0] = true;
+    toVisit.push(0);
+    while (!toVisit.empty()) {
+        const ResolvedDll &dll = resolved[toVisit.front()];
+        toVisit.pop();
+        for (const DllImport &import : dll.imports) {
+            auto it = index.find(import.name);
+            if (import.delayLoaded || it == index.end() || startupLoad[it->second])
+                continue;
+            startupLoad[it->second] = true;
+            toVisit.push(it->second);
+        }
+    }
+
+    std::vector<Image> images;
+    for (size_t i : getLoadOrder(resolved)) {
+        if (!startupLoad[i])
+            continue;
+        Image image;
+        image.dll = i;
+        auto costOrError = getLoadCost(fs, resolved[i].fullPath, &image.header);
+        if (std::error_code ec = costOrError.getError()) {
+            LogEvent event(LogLevel::Error, "error");
+            event.path = resolved[i].fullPath;
+            event.message = ec.message();
+            logger.write(event);
+            continue;
+        }
+        image.cost = *costOrError;
+        images.push_back(std::move(image));
+    }
+
+    auto isFixed = [](const Image &image) -> bool {
+        return !(image.header.dllCharacteristics & llvm::COFF::IMAGE_DLL_CHARACTERISTICS_DYNAMIC_BASE);
+    };
+    auto overlap = [](const Image &a, const Image &b) -> bool {
+        return a.header.imageBase < b.header.imageBase + b.header.sizeOfImage &&
+            b.header.imageBase < a.header.imageBase + a.header.sizeOfImage;
+    };
+
+    // ASLR images are placed at a random base anyway, so only the preferred
+    // ranges of fixed-base images compete; in load order, the first image to
+    // claim a range keeps it and any later overlapping image is relocated
+    for (size_t i = 0; i < images.size(); ++i) {
+        if (!isFixed(images[i]))
+            continue;
+        for (size_t j = 0; j < images.size(); ++j) {
+            if (j != i && isFixed(images[j]) && overlap(images[i], images[j]))
+                images[i].overlaps.push_back(images[j].dll);
+        }
+        for (size_t j = 0; j < i && !images[i].relocated; ++j)
+            images[i].relocated = isFixed(images[j]) && !images[j].relocated && overlap(images[i], images[j]);
+    }
+
+    os << "DLL                                       ImageBase                End ASLR   Relocs Reloc bytes Overlaps\n";
+
+    uint64_t relocatedCount = 0;
+    uint64_t relocationCount = 0;
+    uint64_t relocationBytes = 0;
+
+    for (const Image &image : images) {
+        os << llvm::format("%-32s %#18llx %#18llx %4s %8llu %11llu",
+                           resolved[image.dll].name.c_str(),
+                           (unsigned long long)image.header.imageBase,
+                           (unsigned long long)(image.header.imageBase + image.header.sizeOfImage),
+                           isFixed(image) ? "no" : "yes",
+                           (unsigned long long)image.cost.baseRelocations,
+                           (unsigned long long)image.cost.relocationBytes);
+        for (size_t i = 0; i < image.overlaps.size(); ++i)
+            os << (i ? "," : " ") << resolved[image.overlaps[i]].name;
+        if (image.relocated) {
+            os << (image.header.relocsStripped ? " (relocations stripped, cannot load)" : " (relocated)");
+            ++relocatedCount;
+            relocationCount += image.cost.baseRelocations;
+            relocationBytes += image.cost.relocationBytes;
+        }
+        os << "\n";
+    }
+
+    os << relocatedCount << " fixed-base images relocated at startup, "
+       << relocationCount << " relocations to apply from "
+       << relocationBytes << " bytes of relocation blocks\n";
+}
+
+void printSoftDependencyReport(const std::vector<ResolvedDll> &resolved, const std::vector<std::pair<size_t, std::string>> &softDependencies)
+{
+    llvm::raw_ostream &os = llvm::outs();
+
+    llvm::StringMap<size_t> index;
+    for (size_t i = 0; i < resolved.size(); ++i)
+        index.insert({resolved[i].name, i});
+
+    // the path is that of the DLL bundled, when asked to
+    os << "Soft dependency                  Importer                         Path\n";
+
+    for (const auto &dependency : softDependencies) {
+        auto it = index.find(dependency.second);
+        os << llvm::format("%-32s %-32s ", dependency.second.c_str(), resolved[dependency.first].name.c_str())
+           << (it != index.end() ? resolved[it->second].fullPath : "") << "\n";
+    }
+}
+
+void printConflictReport(llvm::vfs::FileSystem &fs, const std::vector<ResolvedDll> &resolved)
+{
+    llvm::raw_ostream &os = llvm::outs();
+
+    // the identity of each DLL is read once, and the exports shared by each
+    // pair counted from the DLLs exporting each name, so that only the pairs
+    // which share something are ever looked at
+    std::vector<LibraryIdentity> identities(resolved.size());
+    llvm::StringMap<std::vector<size_t>> exporters;
+    for (size_t i = 0; i < resolved.size(); ++i) {
+        if (resolved[i].root)
+            continue;
+        auto identityOrError = getLibraryIdentity(fs, resolved[i].fullPath);
+        if (identityOrError.getError())
+            continue;
+        identities[i] = std::move(*identityOrError);
+        for (const std::string &name : identities[i].exports)
+            exporters[name].push_back(i);
+    }
+
+    std::map<std::pair<size_t, size_t>, size_t> sharedExports;
+    for (const auto &item : exporters) {
+        const std::vector<size_t> &dlls = item.getValue();
+        for (size_t a = 0; a < dlls.size(); ++a) {
+            for (size_t b = a + 1; b < dlls.size(); ++b)
+                ++sharedExports[{dlls[a], dlls[b]}];
+        }
+    }
+
+    std::vector<size_t> parents(resolved.size());
+    for (size_t i = 0; i < parents.size(); ++i)
+        parents[i] = i;
+    auto findGroup = [&](size_t i) {
+        while (parents[i] != i)
+            i = parents[i] = parents[parents[i]];
+        return i;
+    };
+
+    for (const auto &item : sharedExports) {
+        size_t a = item.first.first;
+        size_t b = item.first.second;
+        size_t shared = item.second;
+        if (shared < conflictMinSharedExports)
+            continue;
+        double similarity = double(shared) / double(identities[a].exports.size() + identities[b].exports.size() - shared);
+#if LLVM_VERSION_MAJOR >= 13
+        bool sameProduct = !identities[a].productName.empty() &&
+            llvm::StringRef(identities[a].productName).equals_insensitive(identities[b].productName);
+#else
+        bool sameProduct = !identities[a].productName.empty() &&
+            llvm::StringRef(identities[a].productName).equals_lower(identities[b].productName);
+#endif
+        if (similarity >= (sameProduct ? conflictMinProductSimilarity : conflictMinSimilarity))
+            parents[findGroup(a)] = findGroup(b);
+    }
+
+    // consolidating keeps the largest version, which usually exports what
+    // the others do, and saves the others
+    struct Group {
+        std::vector<size_t> dlls;
+        uint64_t savedBytes = 0;
+    };
+
+    std::map<size_t, Group> groupsByParent;
+    for (size_t i = 0; i < resolved.size(); ++i) {
+        if (!identities[i].exports.empty())
+            groupsByParent[findGroup(i)].dlls.push_back(i);
+    }
+
+    std::vector<Group> groups;
+    for (auto &item : groupsByParent) {
+        Group &group = item.second;
+        if (group.dlls.size() < 2)
+            continue;
+        std::sort(group.dlls.begin(), group.dlls.end(), [&](size_t a, size_t b) {
+            return resolved[a].size > resolved[b].size;
+        });
+        for (size_t j = 1; j < group.dlls.size(); ++j)
+            group.savedBytes += resolved[group.dlls[j]].size;
+        groups.push_back(std::move(group));
+    }
+
+    std::sort(groups.begin(), groups.end(), [](const Group &a, const Group &b) {
+        return a.savedBytes > b.savedBytes;
+    });
+
+    std::vector<uint32_t> importers(resolved.size());
+    llvm::StringMap<size_t> index;
+    for (size_t i = 0; i < resolved.size(); ++i)
+        index.insert({resolved[i].name, i});
+    for (const ResolvedDll &importer : resolved) {
+        for (const DllImport &import : importer.imports) {
+            auto it = index.find(import.name);
+            if (it != index.end())
+                ++importers[it->second];
+        }
+    }
+
+    os << "Library conflict                 Version                Bytes Importers Exports\n";
+
+    size_t totalSavedDlls = 0;
+    uint64_t totalSavedBytes = 0;
+    for (const Group &group : groups) {
+        const LibraryIdentity &kept = identities[group.dlls.front()];
+        std::string library = kept.productName.empty() ? resolved[group.dlls.front()].name : kept.productName;
+        os << library << ": " << group.dlls.size() << " DLLs, consolidating saves "
+           << group.dlls.size() - 1 << " DLLs and " << group.savedBytes << " bytes\n";
+        for (size_t dll : group.dlls) {
+            os << llvm::format("  %-30s %-16s %12llu %9u %7llu\n",
+                               resolved[dll].name.c_str(),
+                               identities[dll].version.c_str(),
+                               (unsigned long long)resolved[dll].size,
+                               importers[dll],
+                               (unsigned long long)identities[dll].exports.size());
+        }
+        totalSavedDlls += group.dlls.size() - 1;
+        totalSavedBytes += group.savedBytes;
+    }
+
+    os << "Total: " << groups.size() << " libraries in several versions, consolidating saves "
+       << totalSavedDlls << " DLLs and " << totalSavedBytes << " bytes\n";
+}
+
+llvm::ErrorOr<LibraryIdentity> getLibraryIdentity(llvm::vfs::FileSystem &fs, llvm::StringRef filePath)
+{
+    LibraryIdentity identity;
+
+    auto sourceOrError = fs.getBufferForFile(filePath);
+    if (std::error_code ec = sourceOrError.getError())
+        return ec;
+
+    auto objOrError = openCOFFObject(**sourceOrError);
+    if (std::error_code ec = objOrError.getError())
+        return ec;
+
+    llvm::object::COFFObjectFile &obj = **objOrError;
+
+    // ICU and the like append their major version to every symbol, which
+    // would otherwise make its versions share nothing
+    for (const llvm::object::ExportDirectoryEntryRef &entry : obj.export_directories()) {
+        llvm::StringRef name;
+        if (failed(entry.getSymbolName(name)) || name.empty())
+            continue;
+        size_t underscore = name.rfind('_');
+        if (underscore != llvm::StringRef::npos && underscore + 1 < name.size() &&
+            name.drop_front(underscore + 1).find_first_not_of("0123456789") == llvm::StringRef::npos)
+            name = name.take_front(underscore);
+        if (!llvm::is_contained(conflictIgnoredExports, name))
+            identity.exports.push_back(name.str());
+    }
+    std::sort(identity.exports.begin(), identity.exports.end());
+    identity.exports.erase(std::unique(identity.exports.begin(), identity.exports.end()), identity.exports.end());
+
+    llvm::StringRef resource = getVersionResource(obj);
+    if (!resource.empty()) {
+        llvm::StringMap<std::string> strings;
+        readVersionStrings(resource, 0, resource.size(), 0, strings);
+        identity.productName = strings.lookup("ProductName");
+        identity.version = strings.lookup("ProductVersion");
+        if (identity.version.empty())
+            identity.version = strings.lookup("FileVersion");
+    }
+
+    return identity;
+}
+
+// the resource directory is three levels of tables, by type, name and
+// language, whose entries point at the table below with their high bit set;
+// a DLL has one VERSIONINFO, whichever its name and language
+llvm::StringRef getVersionResource(const llvm::object::COFFObjectFile &obj)
+{
+    const llvm::object::data_directory *resourceDir = getDataDirectory(obj, llvm::COFF::RESOURCE_TABLE);
+    llvm::ArrayRef<uint8_t> treeBytes;
+    if (!resourceDir || !resourceDir->RelativeVirtualAddress ||
+        failed(obj.getRvaAndSizeAsBytes(resourceDir->RelativeVirtualAddress, resourceDir->Size, treeBytes)))
+        return {};
+    llvm::StringRef tree = llvm::toStringRef(treeBytes);
+
+    uint32_t offset = 0;
+    for (unsigned level = 0; level < 3; ++level) {
+        if (uint64_t(offset) + 16 > tree.size())
+            return {};
+        uint32_t namedEntries = llvm::support::endian::read16le(tree.data() + offset + 12);
+        uint32_t idEntries = llvm::support::endian::read16le(tree.data() + offset + 14);
+        uint32_t target = 0;
+        for (uint32_t i = (level == 0) ? namedEntries : 0; i < namedEntries + idEntries; ++i) {
+            uint64_t entry = uint64_t(offset) + 16 + 8 * i;
+            if (entry + 8 > tree.size())
+                return {};
+            if (level > 0 || llvm::support::endian::read32le(tree.data() + entry) == resourceTypeVersion) {
+                target = llvm::support::endian::read32le(tree.data() + entry + 4);
+                break;
+            }
+        }
+        bool isTable = target & 0x80000000;
+        if (!target || isTable != (level < 2))
+            return {};
+        offset = target & 0x7fffffff;
+    }
+
+    llvm::ArrayRef<uint8_t> resource;
+    if (uint64_t(offset) + 16 > tree.size() ||
+        failed(obj.getRvaAndSizeAsBytes(llvm::support::endian::read32le(tree.data() + offset),
+                                        llvm::support::endian::read32le(tree.data() + offset + 4), resource)))
+        return {};
+    return llvm::toStringRef(resource);
+}
+
+// VERSIONINFO is a tree of blocks, each of its length, the length and type
+// of its value, a UTF-16 key, then its value and its children on 32 bits;
+// the strings are the children of the tables of the StringFileInfo block,
+// and the first table to name a string wins
+void readVersionStrings(llvm::StringRef resource, size_t begin, size_t end, unsigned depth, llvm::StringMap<std::string> &strings)
+{
+    auto align = [](size_t offset) { return (offset + 3) & ~size_t(3); };
+    for (size_t block = begin; block + 6 <= end; ) {
+        size_t length = llvm::support::endian::read16le(resource.data() + block);
+        size_t valueLength = llvm::support::endian::read16le(resource.data() + block + 2);
+        bool textValue = llvm::support::endian::read16le(resource.data() + block + 4) == 1;
+        if (length < 6 || block + length > end)
+            return;
+        size_t blockEnd = block + length;
+
+        // keys are plain ASCII
+        std::string key;
+        size_t offset = block + 6;
+        for (; offset + 2 <= blockEnd && llvm::support::endian::read16le(resource.data() + offset); offset += 2)
+            key.push_back(char(resource[offset]));
+        size_t value = std::min(align(offset + 2), blockEnd);
+        size_t valueSize = std::min(textValue ? 2 * valueLength : valueLength, blockEnd - value);
+
+        if (depth == 3) {
+            std::string text;
+            if (textValue && !strings.count(key) &&
+                llvm::convertUTF16ToUTF8String(llvm::ArrayRef<char>(resource.data() + value, valueSize & ~size_t(1)), text)) {
+                text.resize(std::strlen(text.c_str()));
+                strings[key] = text;
+            }
+        }
+        else if (depth != 1 || key == "StringFileInfo")
+            readVersionStrings(resource, std::min(align(value + valueSize), blockEnd), blockEnd, depth + 1, strings);
+
+        block = align(blockEnd);
+    }
+}
+
+void printEnvironment(ImageFormat format, const std::vector<std::string> &searchPaths, const std::vector<bool> &usedSearchPaths)
+{
+    // every DLL was taken from the first search path holding a matching
+    // file, so keeping only the paths that supplied one, in their original
+    // order, makes the loader pick the same candidates
+    std::string unixPath;
+    std::string windowsPath;
+
+    for (size_t i = 0; i < searchPaths.size(); ++i) {
+        if (!usedSearchPaths[i])
+            continue;
+        if (!unixPath.empty()) {
+            unixPath.push_back(':');
+            windowsPath.push_back(';');
+        }
+        unixPath.append(searchPaths[i]);
+        windowsPath.append(searchPaths[i]);
+    }
+
+    // the dynamic linker looks for the libraries of ELF binaries in
+    // LD_LIBRARY_PATH
+    if (format == ImageFormat::ELF) {
+        llvm::outs() << "LD_LIBRARY_PATH=" << unixPath << "\n";
+        return;
+    }
+
+    // Wine looks for DLLs in WINEDLLPATH and the Windows PATH it builds from
+    // WINEPATH, never in the host PATH, which only Windows extends
+#if defined(_WIN32)
+    llvm::outs() << "PATH=" << windowsPath << ";%PATH%\n";
+#else
+    llvm::outs() << "WINEDLLPATH=" << unixPath << "\n";
+    llvm::outs() << "WINEPATH=" << windowsPath << "\n";
+#endif
+}
+
+void printIoStats(const IoCounters &counters)
+{
+    LogEvent event(LogLevel::Info, "io-stats");
+    llvm::raw_string_ostream os(event.message);
+    os << counters.stats.load() << " stats, "
+       << counters.opens.load() << " opens, "
+       << counters.directoryListings.load() << " directory listings, "
+       << counters.reads.load() << " reads (" << counters.bytesRead.load() << " bytes)";
+    os.flush();
+    logger.writeStats(event);
+}
+
+void addMemoryPhase(std::vector<MemoryPhase> &phases, const char *name)
+{
+    phases.push_back({name, allocCounters.allocations.load(), allocCounters.bytes.load()});
+}
+
+void printMemoryStats(const std::vector<MemoryPhase> &phases, const IoCounters &counters, const MappingBudget *budget)
+{
+    // the phases hold running totals, each one is reported on its own
+    auto writeLine = [](const std::string &line) {
+        LogEvent event(LogLevel::Info, "memory");
+        event.message = line;
+        logger.writeStats(event);
+    };
+
+    uint64_t allocations = 0;
+    uint64_t bytes = 0;
+    for (const MemoryPhase &phase : phases) {
+        writeLine(std::string(phase.name) + ": " + std::to_string(phase.allocations - allocations) + " allocations (" +
+                  std::to_string(phase.bytes - bytes) + " bytes)");
+        allocations = phase.allocations;
+        bytes = phase.bytes;
+    }
+    writeLine("peak resident size " + std::to_string(getPeakResidentSize()) + " bytes, peak mapped files " +
+              std::to_string(counters.peakMappedBytes.load()) + " bytes");
+    if (budget) {
+        writeLine("peak file buffers " + std::to_string(budget->getPeak()) + " bytes, budget " +
+                  std::to_string(budget->getLimit()) + " bytes");
+    }
+}
+
+int64_t getModificationTime(const llvm::vfs::Status &status)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(status.getLastModificationTime().time_since_epoch()).count();
+}
+
+int64_t getMicroseconds(std::chrono::steady_clock::time_point since)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - since).count();
+}
+
+uint64_t getPeakResidentSize()
+{
+#if !defined(_WIN32)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if defined(__APPLE__)
+    return usage.ru_maxrss;
+#else
+    return uint64_t(usage.ru_maxrss) * 1024;
+#endif
+#else
+    return 0;
+#endif
+}
+
+bool parseByteSize(llvm::StringRef text, uint64_t &size)
+{
+    unsigned shift = 0;
+    if (text.endswith("K") || text.endswith("k"))
+        shift = 10;
+    else if (text.endswith("M") || text.endswith("m"))
+        shift = 20;
+    else if (text.endswith("G") || text.endswith("g"))
+        shift = 30;
+    if (shift != 0)
+        text = text.drop_back();
+
+    if (text.getAsInteger(10, size) || size > (UINT64_MAX >> shift))
+        return false;
+    size <<= shift;
+    return true;
+}
+
+uint64_t hashContents(llvm::StringRef data)
+{
+    if (data.size() <= hashChunkSize)
+        return llvm::xxHash64(data);
+
+    // large files are hashed as independent chunks in parallel, the result
+    // being the hash of the chunk hashes, whatever the number of threads
+    size_t chunkCount = (data.size() + hashChunkSize - 1) / hashChunkSize;
+    std::vector<uint64_t> chunkHashes(chunkCount);
+    auto hashChunks = [&](size_t first, size_t step) {
+        for (size_t i = first; i < chunkCount; i += step)
+            chunkHashes[i] = llvm::xxHash64(data.substr(i * hashChunkSize, hashChunkSize));
+    };
+
+    size_t threadCount = std::min<size_t>(chunkCount, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threadCount; ++i)
+        threads.emplace_back(hashChunks, i, threadCount);
+    hashChunks(0, threadCount);
+    for (std::thread &thread : threads)
+        thread.join();
+
+    std::string digests;
+    for (uint64_t chunkHash : chunkHashes) {
+        for (unsigned i = 0; i < 8; ++i)
+            digests.push_back(char(chunkHash >> (8 * i)));
+    }
+    return llvm::xxHash64(digests);
+}
+
+// the patch header gives the size and hash of both versions, then come the
+// operations, an add of literal bytes or a copy from the previous version,
+// with their arguments in ULEB128
+std::string makePatch(llvm::StringRef oldData, llvm::StringRef newData)
+{
+    std::string patch;
+    llvm::raw_string_ostream os(patch);
+    llvm::support::endian::Writer writer(os, llvm::support::little);
+    os.write(patchMagic, sizeof(patchMagic));
+    writer.write<uint64_t>(oldData.size());
+    writer.write<uint64_t>(hashContents(oldData));
+    writer.write<uint64_t>(newData.size());
+    writer.write<uint64_t>(hashContents(newData));
+
+    // a polynomial hash of each block, which can be rolled byte by byte
+    const uint32_t multiplier = 0x01000193;
+    uint32_t outgoing = 1;
+    for (size_t i = 1; i < patchBlockSize; ++i)
+        outgoing *= multiplier;
+    auto hashBlock = [&](const char *block) {
+        uint32_t hash = 0;
+        for (size_t i = 0; i < patchBlockSize; ++i)
+            hash = hash * multiplier + uint8_t(block[i]);
+        return hash;
+    };
+
+    // the blocks of the previous version at aligned offsets, one per slot,
+    // the first block keeping it, so that runs of identical blocks match
+    // from their start, and collisions only lose candidates
+    size_t slotCount = 1;
+    while (slotCount < 2 * (oldData.size() / patchBlockSize))
+        slotCount *= 2;
+    std::vector<uint32_t> slots(slotCount, UINT32_MAX);
+    for (size_t offset = 0; offset + patchBlockSize <= oldData.size() && offset < UINT32_MAX; offset += patchBlockSize) {
+        uint32_t &slot = slots[hashBlock(oldData.data() + offset) & (slotCount - 1)];
+        if (slot == UINT32_MAX)
+            slot = offset;
+    }
+
+    auto writeAdd = [&](size_t first, size_t last) {
+        if (first == last)
+            return;
+        os << char(patchOpAdd);
+        llvm::encodeULEB128(last - first, os);
+        os << newData.slice(first, last);
+    };
+
+    size_t literalStart = 0;
+    size_t position = 0;
+    bool hashValid = false;
+    uint32_t hash = 0;
+    while (position + patchBlockSize <= newData.size()) {
+        if (!hashValid) {
+            hash = hashBlock(newData.data() + position);
+            hashValid = true;
+        }
+
+        uint32_t candidate = slots[hash & (slotCount - 1)];
+        if (candidate != UINT32_MAX && memcmp(oldData.data() + candidate, newData.data() + position, patchBlockSize) == 0) {
+            // the match is extended both ways, back into pending literals
+            size_t oldStart = candidate;
+            size_t newStart = position;
+            while (newStart > literalStart && oldStart > 0 && oldData[oldStart - 1] == newData[newStart - 1]) {
+                --oldStart;
+                --newStart;
+            }
+            size_t length = position - newStart + patchBlockSize;
+            while (newStart + length < newData.size() && oldStart + length < oldData.size() &&
+                   oldData[oldStart + length] == newData[newStart + length])
+                ++length;
+
+            writeAdd(literalStart, newStart);
+            os << char(patchOpCopy);
+            llvm::encodeULEB128(oldStart, os);
+            llvm::encodeULEB128(length, os);
+            position = literalStart = newStart + length;
+            hashValid = false;
+            continue;
+        }
+
+        if (position + patchBlockSize < newData.size())
+            hash = (hash - uint8_t(newData[position]) * outgoing) * multiplier + uint8_t(newData[position + patchBlockSize]);
+        ++position;
+    }
+    writeAdd(literalStart, newData.size());
+
+    os.flush();
+    return patch;
+}
+
+llvm::ErrorOr<std::string> applyPatch(llvm::StringRef oldData, llvm::StringRef patch)
+{
+    std::error_code invalid = std::make_error_code(std::errc::illegal_byte_sequence);
+    if (!patch.startswith(llvm::StringRef(patchMagic, sizeof(patchMagic))))
+        return invalid;
+
+    llvm::DataExtractor extractor(patch, true, 8);
+    llvm::DataExtractor::Cursor cursor(sizeof(patchMagic));
+    uint64_t oldSize = extractor.getU64(cursor);
+    uint64_t oldHash = extractor.getU64(cursor);
+    uint64_t newSize = extractor.getU64(cursor);
+    uint64_t newHash = extractor.getU64(cursor);
+    if (!cursor) {
+        llvm::consumeError(cursor.takeError());
+        return invalid;
+    }
+    if (oldData.size() != oldSize || hashContents(oldData) != oldHash)
+        return std::make_error_code(std::errc::invalid_argument);
+
+    std::string newData;
+    newData.reserve(newSize);
+    while (cursor && cursor.tell() < patch.size() && newData.size() <= newSize) {
+        uint8_t op = extractor.getU8(cursor);
+        if (op == patchOpAdd) {
+            uint64_t length = extractor.getULEB128(cursor);
+            newData.append(extractor.getBytes(cursor, length).str());
+        }
+        else if (op == patchOpCopy) {
+            uint64_t offset = extractor.getULEB128(cursor);
+            uint64_t length = extractor.getULEB128(cursor);
+            if (offset > oldData.size() || length > oldData.size() - offset)
+                return invalid;
+            newData.append(oldData.data() + offset, length);
+        }
+        else
+            return invalid;
+    }
+
+    if (!cursor) {
+        llvm::consumeError(cursor.takeError());
+        return invalid;
+    }
+    if (newData.size() != newSize || hashContents(newData) != newHash)
+        return invalid;
+    return newData;
+}
+
+void writePatch(llvm::vfs::FileSystem &fs, const CopyJob &job, llvm::StringRef patchDir)
+{
+    llvm::SmallString<256> patchPath(patchDir);
+    llvm::sys::path::append(patchPath, job.patchName + ".patch");
+
+    auto report = [&](llvm::StringRef path, const std::string &message) {
+        LogEvent event(LogLevel::Error, "error");
+        event.path = path;
+        event.message = message;
+        logger.write(event);
+    };
+
+    // a destination which is not the version of the lock cannot be patched
+    auto oldOrError = fs.getBufferForFile(job.to);
+    if (std::error_code ec = oldOrError.getError())
+        return report(job.to, ec.message());
+    llvm::StringRef oldData = (*oldOrError)->getBuffer();
+    if (oldData.size() != job.patchBaseSize || hashContents(oldData) != job.patchBaseHash)
+        return report(job.to, "not the version of the lock, no patch written");
+
+    auto newOrError = fs.getBufferForFile(job.from);
+    if (std::error_code ec = newOrError.getError())
+        return report(job.from, ec.message());
+
+    std::string patch = makePatch(oldData, (*newOrError)->getBuffer());
+    if (std::error_code ec = llvm::sys::fs::create_directories(patchDir))
+        return report(patchDir, ec.message());
+    std::error_code ec;
+    llvm::raw_fd_ostream os(patchPath, ec);
+    if (!ec) {
+        os << patch;
+        os.close();
+        ec = os.error();
+    }
+    if (ec)
+        return report(patchPath, ec.message());
+
+    LogEvent event(LogLevel::Info, "patch");
+    event.name = job.patchName;
+    event.path = patchPath;
+    event.bytes = patch.size();
+    logger.write(event);
+}
+
+std::string getDefaultHashCachePath()
+{
+    llvm::SmallString<256> cachePath;
+    if (!llvm::sys::path::cache_directory(cachePath))
+        return std::string();
+    llvm::sys::path::append(cachePath, "dll-bundler", "hashes");
+    return std::string(cachePath.str());
+}
+
+llvm::ErrorOr<std::vector<LockEntry>> readLockFile(llvm::StringRef lockPath)
+{
+    std::vector<LockEntry> entries;
+
+    auto bufferOrError = llvm::MemoryBuffer::getFile(lockPath);
+    if (std::error_code ec = bufferOrError.getError())
+        return ec;
+
+    llvm::SmallVector<llvm::StringRef, 64> lines;
+    (*bufferOrError)->getBuffer().split(lines, '\n', -1, false);
+    for (llvm::StringRef line : lines) {
+        line = line.trim();
+        if (line.empty() || line.startswith("#"))
+            continue;
+        llvm::SmallVector<llvm::StringRef, 3> fields;
+        line.split(fields, ' ', 2);
+        LockEntry entry;
+        if (fields.size() != 3 ||
+            fields[0].getAsInteger(16, entry.hash) ||
+            fields[1].getAsInteger(10, entry.size))
+            return std::make_error_code(std::errc::illegal_byte_sequence);
+        entry.name = fields[2].str();
+        entries.push_back(std::move(entry));
+    }
+
+    return entries;
+}
+
+std::error_code writeLockFile(llvm::StringRef lockPath, const std::vector<ResolvedDll> &resolved)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(lockPath, ec);
+    if (ec)
+        return ec;
+
+    // one "hash size name" line per bundled DLL, in resolution order
+    os << "# dll-bundler lock\n";
+    for (const ResolvedDll &dll : resolved) {
+        if (dll.root)
+            continue;
+        os << llvm::format_hex_no_prefix(dll.hash, 16) << ' ' << dll.size << ' ' << dll.name << '\n';
+    }
+
+    os.close();
+    return os.error();
+}
+
+std::vector<size_t> getLoadOrder(const std::vector<ResolvedDll> &resolved)
+{
+    llvm::StringMap<size_t> index;
+    for (size_t i = 0; i < resolved.size(); ++i)
+        index.insert({resolved[i].name, i});
+
+    // the loader maps the binaries loaded at startup first, importers
+    // before their imports, and the delay-loaded DLLs only when called
+    std::vector<bool> initialLoad = getStaticallyLoaded(resolved, index, size_t(-1));
+    std::vector<bool> placed(resolved.size());
+    std::vector<size_t> order;
+    order.reserve(resolved.size());
+
+    for (bool delayed : {false, true}) {
+        std::vector<bool> members(resolved.size());
+        for (size_t i = 0; i < resolved.size(); ++i)
+            members[i] = initialLoad[i] != delayed;
+
+        std::vector<size_t> importers(resolved.size());
+        for (size_t i = 0; i < resolved.size(); ++i) {
+            for (const DllImport &import : resolved[i].imports) {
+                auto it = index.find(import.name);
+                if (members[i] && it != index.end() && members[it->second] && it->second != i && (delayed || !import.delayLoaded))
+                    ++importers[it->second];
+            }
+        }
+
+        // topological order, breaking import cycles at the DLL resolved first
+        std::queue<size_t> ready;
+        for (size_t i = 0; i < resolved.size(); ++i) {
+            if (members[i] && importers[i] == 0)
+                ready.push(i);
+        }
+        for (size_t next = 0; next < resolved.size();) {
+            if (ready.empty()) {
+                if (!members[next] || placed[next])
+                    ++next;
+                else
+                    ready.push(next);
+                continue;
+            }
+
+            size_t i = ready.front();
+            ready.pop();
+            if (placed[i])
+                continue;
+            placed[i] = true;
+            order.push_back(i);
+            for (const DllImport &import : resolved[i].imports) {
+                auto it = index.find(import.name);
+                if (it != index.end() && members[it->second] && it->second != i && (delayed || !import.delayLoaded) &&
+                    --importers[it->second] == 0)
+                    ready.push(it->second);
+            }
+        }
+    }
+
+    return order;
+}
+
+std::error_code writeLoadOrder(llvm::StringRef listPath, const std::vector<ResolvedDll> &resolved, const std::vector<std::string> &destinationDirs, const std::vector<size_t> &rootDestinations)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(listPath, ec);
+    if (ec)
+        return ec;
+
+    // one path per line, each destination in turn, as packaging tools
+    // take their lists of files
+    std::vector<size_t> order = getLoadOrder(resolved);
+    std::vector<std::vector<bool>> dllDestinations = getDllDestinations(resolved, rootDestinations, destinationDirs.size());
+    for (size_t destination = 0; destination < destinationDirs.size(); ++destination) {
+        for (size_t i : order) {
+            if (resolved[i].root ? rootDestinations[i] != destination : !dllDestinations[i][destination])
+                continue;
+            llvm::SmallString<256> path(destinationDirs[destination]);
+            llvm::sys::path::append(path, llvm::sys::path::filename(resolved[i].fullPath));
+            os << path << '\n';
+        }
+    }
+
+    os.close();
+    return os.error();
+}
+
+std::vector<std::vector<bool>> getDllDestinations(const std::vector<ResolvedDll> &resolved, const std::vector<size_t> &rootDestinations, size_t destinationCount)
+{
+    llvm::StringMap<size_t> index;
+    for (size_t i = 0; i < resolved.size(); ++i) {
+        if (!resolved[i].root)
+            index.insert({resolved[i].name, i});
+    }
+
+    // a DLL goes wherever a binary imports it, directly or not, delay-loaded
+    // imports included
+    std::vector<std::vector<bool>> destinations(resolved.size(), std::vector<bool>(destinationCount));
+    for (size_t root = 0; root < rootDestinations.size(); ++root) {
+        size_t destination = rootDestinations[root];
+        std::queue<size_t> toVisit;
+        toVisit.push(root);
+        while (!toVisit.empty()) {
+            const ResolvedDll &dll = resolved[toVisit.front()];
+            toVisit.pop();
+            for (const DllImport &import : dll.imports) {
+                auto it = index.find(import.name);
+                if (it == index.end() || destinations[it->second][destination])
+                    continue;
+                destinations[it->second][destination] = true;
+                toVisit.push(it->second);
+            }
+        }
+    }
+
+    return destinations;
+}
+
+std::vector<bool> getStaticallyLoaded(const std::vector<ResolvedDll> &resolved, const llvm::StringMap<size_t> &index, size_t excluded)
+{
+    std::vector<bool> loaded(resolved.size());
+    std::queue<size_t> toVisit;
+
+    for (size_t i = 0; i < resolved.size() && resolved[i].root; ++i) {
+        loaded[i] = true;
+        toVisit.push(i);
+    }
+
+    while (!toVisit.empty()) {
+        const ResolvedDll &dll = resolved[toVisit.front()];
+        toVisit.pop();
+        for (const DllImport &import : dll.imports) {
+            if (import.delayLoaded)
+                continue;
+            auto it = index.find(import.name);
+            if (it == index.end() || it->second == excluded || loaded[it->second])
+                continue;
+            loaded[it->second] = true;
+            toVisit.push(it->second);
+        }
+    }
+
+    return loaded;
+}
+
+ImageHeader getImageHeader(const llvm::object::COFFObjectFile &obj)
+{
+    ImageHeader header;
+    header.imageBase = obj.getImageBase();
+
+#if LLVM_VERSION_MAJOR >= 11
+    const llvm::object::pe32_header *pe32 = obj.getPE32Header();
+    const llvm::object::pe32plus_header *pe32plus = obj.getPE32PlusHeader();
+#else
+    const llvm::object::pe32_header *pe32 = nullptr;
+    const llvm::object::pe32plus_header *pe32plus = nullptr;
+    if (obj.getPE32Header(pe32))
+        pe32 = nullptr;
+    if (obj.getPE32PlusHeader(pe32plus))
+        pe32plus = nullptr;
+#endif
+
+    if (pe32plus) {
+        header.sizeOfImage = pe32plus->SizeOfImage;
+        header.dllCharacteristics = pe32plus->DLLCharacteristics;
+    }
+    else if (pe32) {
+        header.sizeOfImage = pe32->SizeOfImage;
+        header.dllCharacteristics = pe32->DLLCharacteristics;
+    }
+
+    header.relocsStripped = obj.getCharacteristics() & llvm::COFF::IMAGE_FILE_RELOCS_STRIPPED;
+
+    return header;
+}
+
+const llvm::object::data_directory *getDataDirectory(const llvm::object::COFFObjectFile &obj, uint32_t index)
+{
+#if LLVM_VERSION_MAJOR >= 11
+    return obj.getDataDirectory(index);
+#else
+    const llvm::object::data_directory *dir = nullptr;
+    if (obj.getDataDirectory(index, dir))
+        return nullptr;
+    return dir;
+#endif
+}
+
+#if LLVM_VERSION_MAJOR < 11
+bool failed(std::error_code ec)
+{
+    return bool(ec);
+}
+#endif
+
+bool failed(llvm::Error err)
+{
+    return bool(llvm::errorToErrorCode(std::move(err)));
+}
+
+CopyQueue::CopyQueue(size_t capacity)
+    : capacity(capacity)
+{
+}
+
+void CopyQueue::push(CopyJob job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this]() { return jobs.size() < capacity; });
+    jobs.push_back(std::move(job));
+    std::push_heap(jobs.begin(), jobs.end(), smallerJob);
+    notEmpty.notify_one();
+}
+
+bool CopyQueue::pop(CopyJob &job)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this]() { return !jobs.empty() || closed; });
+    if (jobs.empty())
+        return false;
+    std::pop_heap(jobs.begin(), jobs.end(), smallerJob);
+    job = std::move(jobs.back());
+    jobs.pop_back();
+    notFull.notify_one();
+    return true;
+}
+
+void CopyQueue::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+}
+
+bool CopyQueue::smallerJob(const CopyJob &a, const CopyJob &b)
+{
+    return a.size < b.size;
+}
+
+std::error_code HashCache::load(llvm::StringRef cachePath)
+{
+    auto bufferOrError = llvm::MemoryBuffer::getFile(cachePath);
+    if (std::error_code ec = bufferOrError.getError())
+        return ec;
+
+    // one "device inode size mtime hash" line per file, in hexadecimal
+    std::lock_guard<std::mutex> lock(mutex);
+    llvm::SmallVector<llvm::StringRef, 64> lines;
+    (*bufferOrError)->getBuffer().split(lines, '\n', -1, false);
+    for (llvm::StringRef line : lines) {
+        llvm::SmallVector<llvm::StringRef, 5> fields;
+        line.split(fields, ' ');
+        FileId id;
+        FileHashEntry entry;
+        uint64_t mtimeNs;
+        if (fields.size() != 5 ||
+            fields[0].getAsInteger(16, id.first) ||
+            fields[1].getAsInteger(16, id.second) ||
+            fields[2].getAsInteger(16, entry.size) ||
+            fields[3].getAsInteger(16, mtimeNs) ||
+            fields[4].getAsInteger(16, entry.hash))
+            continue;
+        entry.mtimeNs = int64_t(mtimeNs);
+        entries[id] = entry;
+    }
+
+    return std::error_code();
+}
+
+std::error_code HashCache::save(llvm::StringRef cachePath)
+{
+    llvm::StringRef cacheDir = llvm::sys::path::parent_path(cachePath);
+    if (!cacheDir.empty()) {
+        if (std::error_code ec = llvm::sys::fs::create_directories(cacheDir))
+            return ec;
+    }
+
+    // written to a file of its own and renamed, so concurrent runs never
+    // read a partial file; the entries of files this run did not come
+    // across, deleted ones among them, are dropped so the cache stays small
+    int fd;
+    llvm::SmallString<256> temporaryPath;
+    if (std::error_code ec = llvm::sys::fs::createUniqueFile(cachePath + "-%%%%%%%%.tmp", fd, temporaryPath))
+        return ec;
+    {
+        llvm::raw_fd_ostream os(fd, true);
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto &item : entries) {
+            if (!item.second.seen)
+                continue;
+            os << llvm::format_hex_no_prefix(item.first.first, 1) << ' '
+               << llvm::format_hex_no_prefix(item.first.second, 1) << ' '
+               << llvm::format_hex_no_prefix(item.second.size, 1) << ' '
+               << llvm::format_hex_no_prefix(uint64_t(item.second.mtimeNs), 1) << ' '
+               << llvm::format_hex_no_prefix(item.second.hash, 16) << '\n';
+        }
+        os.close();
+        if (os.has_error()) {
+            llvm::sys::fs::remove(temporaryPath);
+            return os.error();
+        }
+    }
+
+    std::error_code ec = llvm::sys::fs::rename(temporaryPath, cachePath);
+    if (ec)
+        llvm::sys::fs::remove(temporaryPath);
+    return ec;
+}
+
+llvm::ErrorOr<uint64_t> HashCache::getFileHash(llvm::vfs::FileSystem &fs, llvm::StringRef filePath)
+{
+    auto statusOrError = fs.status(filePath);
+    if (std::error_code ec = statusOrError.getError())
+        return ec;
+
+    FileId id(statusOrError->getUniqueID().getDevice(), statusOrError->getUniqueID().getFile());
+    int64_t mtimeNs = getModificationTime(*statusOrError);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = entries.find(id);
+        if (it != entries.end() && it->second.size == statusOrError->getSize() && it->second.mtimeNs == mtimeNs) {
+            it->second.seen = true;
+            return it->second.hash;
+        }
+    }
+
+    auto bufferOrError = fs.getBufferForFile(filePath, -1, false);
+    if (std::error_code ec = bufferOrError.getError())
+        return ec;
+
+    FileHashEntry entry;
+    entry.size = statusOrError->getSize();
+    entry.mtimeNs = mtimeNs;
+    entry.hash = hashContents((*bufferOrError)->getBuffer());
+    entry.seen = true;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[id] = entry;
+    return entry.hash;
+}
+
+void HashCache::setFileHash(llvm::vfs::FileSystem &fs, llvm::StringRef filePath, uint64_t hash)
+{
+    auto statusOrError = fs.status(filePath);
+    if (!statusOrError)
+        return;
+
+    FileId id(statusOrError->getUniqueID().getDevice(), statusOrError->getUniqueID().getFile());
+    FileHashEntry entry;
+    entry.size = statusOrError->getSize();
+    entry.mtimeNs = getModificationTime(*statusOrError);
+    entry.hash = hash;
+    entry.seen = true;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    entries[id] = entry;
+}
+
+std::error_code Journal::open(llvm::vfs::FileSystem &fs, llvm::StringRef path, const std::vector<std::string> &rootBinaryFiles, const std::vector<std::string> &searchPaths, bool softImports)
+{
+    journalPath = path.str();
+
+    // a search path modified since, by a DLL added or removed, voids the
+    // resolutions, though not the copies, which are checked one by one, and
+    // so do soft dependencies taken as imports in one run and not the other
+    std::string header = "H\t" + std::to_string(rootBinaryFiles.size()) + '\t' + (softImports ? "1" : "0");
+    for (const std::string &rootBinaryFile : rootBinaryFiles)
+        header += '\t' + rootBinaryFile;
+    for (const std::string &searchPath : searchPaths) {
+        auto statusOrError = fs.status(searchPath);
+        header += '\t' + searchPath + '\t' + std::to_string(statusOrError ? getModificationTime(*statusOrError) : 0);
+    }
+
+    auto bufferOrError = llvm::MemoryBuffer::getFile(journalPath);
+    if (bufferOrError)
+        load((*bufferOrError)->getBuffer(), header);
+    else if (bufferOrError.getError() != std::errc::no_such_file_or_directory)
+        return bufferOrError.getError();
+
+    // the records taken over are written again, so the journal does not
+    // keep growing with the entries of every attempt
+    std::string contents = "# dll-bundler journal\n" + header + "\n";
+    for (const auto &item : resolutions) {
+        const JournalResolution &resolution = item.second;
+        const ResolvedDll &dll = resolution.dll;
+        contents += "R\t" + dll.name + '\t' + dll.fullPath + '\t' + std::to_string(dll.size) + '\t' +
+                    std::to_string(resolution.mtimeNs) + '\t' + resolution.searchPath + '\t' +
+                    std::to_string(dll.imports.size()) + '\t' + std::to_string(dll.runPaths.size()) + '\n';
+        for (const DllImport &import : dll.imports)
+            contents += "I\t" + import.name + '\t' + (import.delayLoaded ? "1" : "0") + '\t' + std::to_string(import.functionCount) + '\n';
+        for (const std::string &runPath : dll.runPaths)
+            contents += "P\t" + runPath + '\n';
+    }
+    for (const auto &item : copies) {
+        const JournalCopy &copy = item.second;
+        contents += "C\t" + item.first().str() + '\t' + copy.from + '\t' + std::to_string(copy.fromSize) + '\t' +
+                    std::to_string(copy.fromMtimeNs) + '\t' + std::to_string(copy.toSize) + '\t' +
+                    std::to_string(copy.toMtimeNs) + '\n';
+    }
+
+    std::error_code ec;
+    os.reset(new llvm::raw_fd_ostream(journalPath, ec));
+    if (!ec) {
+        *os << contents;
+        os->flush();
+        ec = os->error();
+    }
+    if (ec)
+        os.reset();
+    return ec;
+}
+
+void Journal::load(llvm::StringRef data, llvm::StringRef header)
+{
+    llvm::SmallVector<llvm::StringRef, 256> lines;
+    data.split(lines, '\n', -1, false);
+    // the last line is partial when the run stopped while writing it
+    bool truncated = !data.endswith("\n") && !lines.empty();
+    if (truncated)
+        lines.pop_back();
+
+    bool sameSearch = lines.size() >= 2 && lines[1] == header;
+    for (size_t i = 2; i < lines.size(); ++i) {
+        llvm::SmallVector<llvm::StringRef, 8> fields;
+        lines[i].split(fields, '\t');
+        uint64_t mtimeNs;
+        uint64_t otherMtimeNs;
+        if (fields[0] == "C") {
+            JournalCopy copy;
+            if (fields.size() != 7 ||
+                fields[3].getAsInteger(10, copy.fromSize) ||
+                fields[4].getAsInteger(10, mtimeNs) ||
+                fields[5].getAsInteger(10, copy.toSize) ||
+                fields[6].getAsInteger(10, otherMtimeNs))
+                continue;
+            copy.from = fields[2].str();
+            copy.fromMtimeNs = int64_t(mtimeNs);
+            copy.toMtimeNs = int64_t(otherMtimeNs);
+            copies[fields[1]] = copy;
+            continue;
+        }
+
+        // a resolution is followed by its imports, then its library paths
+        JournalResolution resolution;
+        size_t importCount;
+        size_t runPathCount;
+        if (fields[0] != "R" || fields.size() != 8 ||
+            fields[3].getAsInteger(10, resolution.dll.size) ||
+            fields[4].getAsInteger(10, mtimeNs) ||
+            fields[6].getAsInteger(10, importCount) ||
+            fields[7].getAsInteger(10, runPathCount))
+            continue;
+        // only the record being written when the run stopped may run past
+        // the end, any other is corrupt, and so is the journal
+        size_t remaining = lines.size() - i - 1;
+        if (importCount > remaining || runPathCount > remaining - importCount) {
+            if (!truncated) {
+                copies.clear();
+                resolutions.clear();
+            }
+            return;
+        }
+        resolution.dll.name = fields[1].str();
+        resolution.dll.fullPath = fields[2].str();
+        resolution.mtimeNs = int64_t(mtimeNs);
+        resolution.searchPath = fields[5].str();
+
+        bool complete = true;
+        for (size_t j = 0; j < importCount && complete; ++j) {
+            llvm::SmallVector<llvm::StringRef, 4> importFields;
+            lines[++i].split(importFields, '\t');
+            DllImport import;
+            complete = importFields.size() == 4 && importFields[0] == "I" &&
+                       !importFields[3].getAsInteger(10, import.functionCount);
+            if (complete) {
+                import.name = importFields[1].str();
+                import.delayLoaded = importFields[2] == "1";
+                resolution.dll.imports.push_back(import);
+            }
+        }
+        for (size_t j = 0; j < runPathCount && complete; ++j) {
+            llvm::StringRef runPath = lines[++i];
+            complete = runPath.consume_front("P\t");
+            resolution.dll.runPaths.push_back(runPath.str());
+        }
+        if (complete && sameSearch)
+            resolutions[resolution.dll.name] = std::move(resolution);
+    }
+}
+
+const JournalResolution *Journal::getResolution(llvm::vfs::FileSystem &fs, llvm::StringRef name) const
+{
+    auto it = resolutions.find(name);
+    if (it == resolutions.end())
+        return nullptr;
+
+    const JournalResolution &resolution = it->second;
+    auto statusOrError = fs.status(resolution.dll.fullPath);
+    if (!statusOrError || statusOrError->getSize() != resolution.dll.size ||
+        getModificationTime(*statusOrError) != resolution.mtimeNs)
+        return nullptr;
+    return &resolution;
+}
+
+bool Journal::isCopied(llvm::vfs::FileSystem &fs, llvm::StringRef from, llvm::StringRef to) const
+{
+    auto it = copies.find(to);
+    if (it == copies.end() || it->second.from != from)
         return false;
 
-    llvm::object::COFFObjectFile &obj = **objOrError;
-    return obj.getArch() == dllArch;
+    const JournalCopy &copy = it->second;
+    auto fromStatus = fs.status(from);
+    auto toStatus = fs.status(to);
+    return fromStatus && fromStatus->getSize() == copy.fromSize && getModificationTime(*fromStatus) == copy.fromMtimeNs &&
+           toStatus && toStatus->getSize() == copy.toSize && getModificationTime(*toStatus) == copy.toMtimeNs;
+}
+
+void Journal::addResolution(llvm::vfs::FileSystem &fs, const ResolvedDll &dll, llvm::StringRef searchPath)
+{
+    auto statusOrError = fs.status(dll.fullPath);
+    if (!statusOrError)
+        return;
+
+    std::string record = "R\t" + dll.name + '\t' + dll.fullPath + '\t' + std::to_string(statusOrError->getSize()) + '\t' +
+                         std::to_string(getModificationTime(*statusOrError)) + '\t' + searchPath.str() + '\t' +
+                         std::to_string(dll.imports.size()) + '\t' + std::to_string(dll.runPaths.size()) + '\n';
+    for (const DllImport &import : dll.imports)
+        record += "I\t" + import.name + '\t' + (import.delayLoaded ? "1" : "0") + '\t' + std::to_string(import.functionCount) + '\n';
+    for (const std::string &runPath : dll.runPaths)
+        record += "P\t" + runPath + '\n';
+    append(record);
+}
+
+void Journal::addCopy(llvm::vfs::FileSystem &fs, llvm::StringRef from, llvm::StringRef to)
+{
+    auto fromStatus = fs.status(from);
+    auto toStatus = fs.status(to);
+    if (!fromStatus || !toStatus)
+        return;
+
+    append("C\t" + to.str() + '\t' + from.str() + '\t' + std::to_string(fromStatus->getSize()) + '\t' +
+           std::to_string(getModificationTime(*fromStatus)) + '\t' + std::to_string(toStatus->getSize()) + '\t' +
+           std::to_string(getModificationTime(*toStatus)) + '\n');
+}
+
+std::error_code Journal::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    std::error_code ec = os->error();
+    os.reset();
+    if (failures || ec)
+        return ec;
+    return llvm::sys::fs::remove(journalPath);
+}
+
+// each record is flushed whole, so an interruption loses at most the one
+// being written, which the next run then drops
+void Journal::append(const std::string &record)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    *os << record;
+    os->flush();
+}
+
+std::error_code GraphView::open(llvm::StringRef data)
+{
+    std::error_code invalid = std::make_error_code(std::errc::illegal_byte_sequence);
+    const size_t headerSize = sizeof(graphDatabaseMagic) + 3 * sizeof(Word);
+    if (data.size() < headerSize || memcmp(data.data(), graphDatabaseMagic, sizeof(graphDatabaseMagic)) != 0)
+        return invalid;
+
+    const Word *header = reinterpret_cast<const Word *>(data.data() + sizeof(graphDatabaseMagic));
+    uint64_t nodeCount = header[0];
+    uint64_t edgeCount = header[1];
+    uint64_t stringSize = header[2];
+    uint64_t words = 3 * nodeCount + 2 * (nodeCount + 1) + 2 * edgeCount;
+    if (data.size() != headerSize + words * sizeof(Word) + stringSize)
+        return invalid;
+
+    const Word *next = header + 3;
+    nodes = next;
+    forwardOffsets = nodes + 3 * nodeCount;
+    forwardTargets = forwardOffsets + nodeCount + 1;
+    reverseOffsets = forwardTargets + edgeCount;
+    reverseTargets = reverseOffsets + nodeCount + 1;
+    strings = data.take_back(stringSize);
+    this->nodeCount = nodeCount;
+
+    // checked once here, so lookups need not check anything
+    for (uint32_t node = 0; node < nodeCount; ++node) {
+        if (uint64_t(nodes[3 * node]) + nodes[3 * node + 1] > stringSize ||
+            forwardOffsets[node] > forwardOffsets[node + 1] ||
+            reverseOffsets[node] > reverseOffsets[node + 1])
+            return invalid;
+    }
+    if (forwardOffsets[nodeCount] != edgeCount || reverseOffsets[nodeCount] != edgeCount)
+        return invalid;
+    for (uint64_t i = 0; i < edgeCount; ++i) {
+        if (forwardTargets[i] >= nodeCount || reverseTargets[i] >= nodeCount)
+            return invalid;
+    }
+    return std::error_code();
+}
+
+llvm::StringRef GraphView::getName(uint32_t node) const
+{
+    return strings.substr(nodes[3 * node], nodes[3 * node + 1]);
+}
+
+bool GraphView::isRoot(uint32_t node) const
+{
+    return nodes[3 * node + 2] & graphNodeRoot;
+}
+
+llvm::ArrayRef<llvm::support::ulittle32_t> GraphView::getEdges(uint32_t node, bool reverse) const
+{
+    const Word *offsets = reverse ? reverseOffsets : forwardOffsets;
+    const Word *targets = reverse ? reverseTargets : forwardTargets;
+    return llvm::makeArrayRef(targets + offsets[node], targets + offsets[node + 1]);
+}
+
+uint32_t GraphView::find(llvm::StringRef name) const
+{
+    uint32_t first = 0;
+    uint32_t last = nodeCount;
+    while (first < last) {
+        uint32_t middle = first + (last - first) / 2;
+        int order = getName(middle).compare(name);
+        if (order == 0)
+            return middle;
+        if (order < 0)
+            first = middle + 1;
+        else
+            last = middle;
+    }
+    return nodeCount;
+}
+
+std::error_code GraphDatabase::load(llvm::StringRef databasePath)
+{
+    auto bufferOrError = llvm::MemoryBuffer::getFile(databasePath);
+    if (std::error_code ec = bufferOrError.getError())
+        return ec;
+
+    GraphView graph;
+    if (std::error_code ec = graph.open((*bufferOrError)->getBuffer()))
+        return ec;
+
+    for (uint32_t node = 0; node < graph.size(); ++node) {
+        getNode(graph.getName(node));
+        roots[node] = graph.isRoot(node);
+    }
+    for (uint32_t node = 0; node < graph.size(); ++node) {
+        for (uint32_t next : graph.getEdges(node, false))
+            edges[node].push_back(next);
+    }
+    return std::error_code();
+}
+
+std::error_code GraphDatabase::save(llvm::StringRef databasePath)
+{
+    llvm::StringRef databaseDir = llvm::sys::path::parent_path(databasePath);
+    if (!databaseDir.empty()) {
+        if (std::error_code ec = llvm::sys::fs::create_directories(databaseDir))
+            return ec;
+    }
+
+    // nodes are renumbered in name order
+    uint32_t nodeCount = names.size();
+    std::vector<uint32_t> order(nodeCount);
+    for (uint32_t node = 0; node < nodeCount; ++node)
+        order[node] = node;
+    std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) { return names[a] < names[b]; });
+    std::vector<uint32_t> renumbered(nodeCount);
+    for (uint32_t node = 0; node < nodeCount; ++node)
+        renumbered[order[node]] = node;
+
+    std::vector<uint32_t> forwardOffsets(1, 0);
+    std::vector<uint32_t> forwardTargets;
+    std::vector<uint32_t> reverseOffsets(nodeCount + 1, 0);
+    for (uint32_t node : order) {
+        size_t first = forwardTargets.size();
+        for (uint32_t next : edges[node]) {
+            forwardTargets.push_back(renumbered[next]);
+            ++reverseOffsets[renumbered[next] + 1];
+        }
+        std::sort(forwardTargets.begin() + first, forwardTargets.end());
+        forwardOffsets.push_back(forwardTargets.size());
+    }
+    for (uint32_t node = 0; node < nodeCount; ++node)
+        reverseOffsets[node + 1] += reverseOffsets[node];
+    std::vector<uint32_t> reverseTargets(forwardTargets.size());
+    std::vector<uint32_t> reverseFill(reverseOffsets.begin(), reverseOffsets.end() - 1);
+    for (uint32_t node = 0; node < nodeCount; ++node) {
+        for (uint32_t i = forwardOffsets[node]; i < forwardOffsets[node + 1]; ++i)
+            reverseTargets[reverseFill[forwardTargets[i]]++] = node;
+    }
+
+    // written to a file of its own and renamed, so that concurrent runs
+    // neither mix their writes nor read a partial file
+    int fd;
+    llvm::SmallString<256> temporaryPath;
+    if (std::error_code ec = llvm::sys::fs::createUniqueFile(databasePath + "-%%%%%%%%.tmp", fd, temporaryPath))
+        return ec;
+    {
+        llvm::raw_fd_ostream os(fd, true);
+        llvm::support::endian::Writer writer(os, llvm::support::little);
+        uint32_t stringSize = 0;
+        for (const std::string &name : names)
+            stringSize += name.size();
+        os.write(graphDatabaseMagic, sizeof(graphDatabaseMagic));
+        writer.write<uint32_t>(nodeCount);
+        writer.write<uint32_t>(forwardTargets.size());
+        writer.write<uint32_t>(stringSize);
+
+        uint32_t nameOffset = 0;
+        for (uint32_t node : order) {
+            writer.write<uint32_t>(nameOffset);
+            writer.write<uint32_t>(names[node].size());
+            writer.write<uint32_t>(roots[node] ? graphNodeRoot : 0);
+            nameOffset += names[node].size();
+        }
+        writer.write<uint32_t>(forwardOffsets);
+        writer.write<uint32_t>(forwardTargets);
+        writer.write<uint32_t>(reverseOffsets);
+        writer.write<uint32_t>(reverseTargets);
+        for (uint32_t node : order)
+            os << names[node];
+
+        os.close();
+        if (os.has_error()) {
+            llvm::sys::fs::remove(temporaryPath);
+            return os.error();
+        }
+    }
+
+    std::error_code ec = llvm::sys::fs::rename(temporaryPath, databasePath);
+    if (ec)
+        llvm::sys::fs::remove(temporaryPath);
+    return ec;
+}
+
+void GraphDatabase::setImports(llvm::StringRef name, bool root, const std::vector<DllImport> &imports)
+{
+    uint32_t node = getNode(name);
+    if (root)
+        roots[node] = true;
+
+    std::vector<uint32_t> nodeEdges;
+    for (const DllImport &import : imports)
+        nodeEdges.push_back(getNode(import.name));
+    std::sort(nodeEdges.begin(), nodeEdges.end());
+    nodeEdges.erase(std::unique(nodeEdges.begin(), nodeEdges.end()), nodeEdges.end());
+    edges[node] = std::move(nodeEdges);
+}
+
+uint32_t GraphDatabase::getNode(llvm::StringRef name)
+{
+    auto inserted = index.insert(std::make_pair(name, uint32_t(names.size())));
+    if (inserted.second) {
+        names.push_back(name.str());
+        roots.push_back(false);
+        edges.emplace_back();
+    }
+    return inserted.first->second;
+}
+
+CountingFileSystem::CountingFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs)
+    : ProxyFileSystem(std::move(fs))
+{
+}
+
+llvm::ErrorOr<llvm::vfs::Status> CountingFileSystem::status(const llvm::Twine &path)
+{
+    ++counters.stats;
+    return ProxyFileSystem::status(path);
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> CountingFileSystem::openFileForRead(const llvm::Twine &path)
+{
+    ++counters.opens;
+    auto fileOrError = ProxyFileSystem::openFileForRead(path);
+    if (std::error_code ec = fileOrError.getError())
+        return ec;
+    return std::unique_ptr<llvm::vfs::File>(new CountingFile(std::move(*fileOrError), counters));
+}
+
+llvm::vfs::directory_iterator CountingFileSystem::dir_begin(const llvm::Twine &dir, std::error_code &ec)
+{
+    ++counters.directoryListings;
+    return ProxyFileSystem::dir_begin(dir, ec);
+}
+
+CountingFile::CountingFile(std::unique_ptr<llvm::vfs::File> file, IoCounters &counters)
+    : file(std::move(file)), counters(counters)
+{
+}
+
+llvm::ErrorOr<llvm::vfs::Status> CountingFile::status()
+{
+    ++counters.stats;
+    return file->status();
+}
+
+llvm::ErrorOr<std::string> CountingFile::getName()
+{
+    return file->getName();
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> CountingFile::getBuffer(const llvm::Twine &name, int64_t fileSize, bool requiresNullTerminator, bool isVolatile)
+{
+    auto bufferOrError = file->getBuffer(name, fileSize, requiresNullTerminator, isVolatile);
+    if (std::error_code ec = bufferOrError.getError())
+        return ec;
+
+    ++counters.reads;
+    counters.bytesRead += (*bufferOrError)->getBufferSize();
+    // buffers read into the heap are already seen by the allocation counters
+    if ((*bufferOrError)->getBufferKind() != llvm::MemoryBuffer::MemoryBuffer_MMap)
+        return bufferOrError;
+    return std::unique_ptr<llvm::MemoryBuffer>(new CountedMemoryBuffer(std::move(*bufferOrError), counters));
+}
+
+std::error_code CountingFile::close()
+{
+    return file->close();
+}
+
+CountedMemoryBuffer::CountedMemoryBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer, IoCounters &counters)
+    : buffer(std::move(buffer)), counters(counters)
+{
+    init(this->buffer->getBufferStart(), this->buffer->getBufferEnd(), false);
+
+    uint64_t mappedBytes = counters.mappedBytes += getBufferSize();
+    uint64_t peakMappedBytes = counters.peakMappedBytes.load();
+    while (mappedBytes > peakMappedBytes && !counters.peakMappedBytes.compare_exchange_weak(peakMappedBytes, mappedBytes))
+        ;
+}
+
+CountedMemoryBuffer::~CountedMemoryBuffer()
+{
+    counters.mappedBytes -= getBufferSize();
+}
+
+MappingBudget::MappingBudget(uint64_t limit)
+    : limit(limit)
+{
+}
+
+void MappingBudget::acquire(uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    if (budgetHeldBytes == 0)
+        released.wait(lock, [&]() { return used == 0 || used + size <= limit; });
+    used += size;
+    peak = std::max(peak, used);
+    budgetHeldBytes += size;
+}
+
+void MappingBudget::release(uint64_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        used -= size;
+        budgetHeldBytes -= size;
+    }
+    released.notify_all();
+}
+
+uint64_t MappingBudget::getPeak() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak;
+}
+
+ConcurrencyController::ConcurrencyController(unsigned initial, unsigned maximum)
+    : limit(std::min(initial, maximum)), maximum(maximum), peak(limit), windowStart(std::chrono::steady_clock::now())
+{
+}
+
+void ConcurrencyController::acquire()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    released.wait(lock, [&]() { return active < limit; });
+    ++active;
+}
+
+void ConcurrencyController::release(uint64_t bytes, int64_t duration)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --active;
+        ++operations;
+        totalLatency += duration;
+        windowBytes += bytes;
+
+        // a window spans several rounds of the current limit, so that the
+        // sizes of the files even out
+        if (++windowOperations >= std::max(concurrencyWindow, 2 * limit)) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            double elapsed = std::max<int64_t>(1, std::chrono::duration_cast<std::chrono::microseconds>(now - windowStart).count());
+            double throughput = windowBytes / elapsed;
+            if (throughput >= lastThroughput * 0.9) {
+                if (limit < maximum) {
+                    ++limit;
+                    ++increases;
+                }
+            }
+            else if (limit > 1) {
+                limit = std::max(1u, limit / 2);
+                ++decreases;
+            }
+            peak = std::max(peak, limit);
+            lastThroughput = throughput;
+            windowStart = now;
+            windowOperations = 0;
+            windowBytes = 0;
+        }
+    }
+    released.notify_all();
+}
+
+// gives back the slot of a job which copied nothing, keeping it out of the
+// window, as its speed tells nothing of the copies
+void ConcurrencyController::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        --active;
+    }
+    released.notify_all();
+}
+
+unsigned ConcurrencyController::getLimit() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return limit;
+}
+
+unsigned ConcurrencyController::getPeak() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return peak;
+}
+
+unsigned ConcurrencyController::getIncreases() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return increases;
+}
+
+unsigned ConcurrencyController::getDecreases() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return decreases;
+}
+
+int64_t ConcurrencyController::getMeanLatency() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return operations ? totalLatency / int64_t(operations) : 0;
+}
+
+BudgetFileSystem::BudgetFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs, MappingBudget &budget)
+    : ProxyFileSystem(std::move(fs)), budget(budget)
+{
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> BudgetFileSystem::openFileForRead(const llvm::Twine &path)
+{
+    auto fileOrError = ProxyFileSystem::openFileForRead(path);
+    if (std::error_code ec = fileOrError.getError())
+        return ec;
+    return std::unique_ptr<llvm::vfs::File>(new BudgetFile(std::move(*fileOrError), budget));
+}
+
+BudgetFile::BudgetFile(std::unique_ptr<llvm::vfs::File> file, MappingBudget &budget)
+    : file(std::move(file)), budget(budget)
+{
+}
+
+llvm::ErrorOr<llvm::vfs::Status> BudgetFile::status()
+{
+    return file->status();
+}
+
+llvm::ErrorOr<std::string> BudgetFile::getName()
+{
+    return file->getName();
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> BudgetFile::getBuffer(const llvm::Twine &name, int64_t fileSize, bool requiresNullTerminator, bool isVolatile)
+{
+    // the room is taken before the file is mapped, from its size on disk
+    uint64_t size = fileSize;
+    if (fileSize < 0) {
+        auto statusOrError = file->status();
+        if (std::error_code ec = statusOrError.getError())
+            return ec;
+        size = statusOrError->getSize();
+    }
+
+    budget.acquire(size);
+    auto bufferOrError = file->getBuffer(name, fileSize, requiresNullTerminator, isVolatile);
+    if (std::error_code ec = bufferOrError.getError()) {
+        budget.release(size);
+        return ec;
+    }
+    return std::unique_ptr<llvm::MemoryBuffer>(new BudgetMemoryBuffer(std::move(*bufferOrError), budget, size));
+}
+
+std::error_code BudgetFile::close()
+{
+    return file->close();
+}
+
+BudgetMemoryBuffer::BudgetMemoryBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer, MappingBudget &budget, uint64_t size)
+    : buffer(std::move(buffer)), budget(budget), size(size)
+{
+    init(this->buffer->getBufferStart(), this->buffer->getBufferEnd(), false);
+}
+
+BudgetMemoryBuffer::~BudgetMemoryBuffer()
+{
+    budget.release(size);
+}
+
+RecordingFileSystem::RecordingFileSystem(llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fs)
+    : ProxyFileSystem(std::move(fs))
+{
+}
+
+llvm::ErrorOr<llvm::vfs::Status> RecordingFileSystem::status(const llvm::Twine &path)
+{
+    auto statusOrError = ProxyFileSystem::status(path);
+    recordStatus(path.str(), statusOrError);
+    return statusOrError;
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> RecordingFileSystem::openFileForRead(const llvm::Twine &path)
+{
+    std::string filePath = path.str();
+    auto fileOrError = ProxyFileSystem::openFileForRead(filePath);
+    if (std::error_code ec = fileOrError.getError()) {
+        recordStatus(filePath, ec);
+        return ec;
+    }
+    return std::unique_ptr<llvm::vfs::File>(new RecordingFile(std::move(*fileOrError), std::move(filePath), *this));
+}
+
+llvm::vfs::directory_iterator RecordingFileSystem::dir_begin(const llvm::Twine &dir, std::error_code &ec)
+{
+    // the whole listing is read ahead, to be recorded in one piece
+    std::string dirPath = dir.str();
+    std::vector<llvm::vfs::directory_entry> entries;
+    for (llvm::vfs::directory_iterator it = ProxyFileSystem::dir_begin(dirPath, ec), end; !ec && it != end; it.increment(ec))
+        entries.push_back(*it);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (ec)
+            trace.failedListings.emplace(dirPath, ec);
+        else
+            trace.listings.emplace(dirPath, entries);
+    }
+    if (ec)
+        return llvm::vfs::directory_iterator();
+    return llvm::vfs::directory_iterator(std::make_shared<ListedDirIterator>(std::move(entries)));
+}
+
+void RecordingFileSystem::recordStatus(const std::string &path, const llvm::ErrorOr<llvm::vfs::Status> &statusOrError)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (statusOrError)
+        trace.statuses.emplace(path, *statusOrError);
+    else
+        trace.failedStatuses.emplace(path, statusOrError.getError());
+}
+
+void RecordingFileSystem::recordRanges(llvm::StringRef path, uint64_t size, std::vector<FileRange> ranges)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    SparseContents &contents = trace.contents[path.str()];
+    contents.size = size;
+    for (const auto &range : contents.ranges)
+        ranges.push_back({range.first, range.second.str()});
+
+    // the names and tables read overlap, and often follow one another
+    std::sort(ranges.begin(), ranges.end(), [](const FileRange &a, const FileRange &b) { return a.offset < b.offset; });
+    std::vector<FileRange> merged;
+    for (FileRange &range : ranges) {
+        if (range.data.empty())
+            continue;
+        if (!merged.empty() && range.offset <= merged.back().offset + merged.back().data.size()) {
+            FileRange &last = merged.back();
+            uint64_t overlap = last.offset + last.data.size() - range.offset;
+            if (overlap < range.data.size())
+                last.data.append(range.data, overlap, std::string::npos);
+        }
+        else
+            merged.push_back(std::move(range));
+    }
+
+    contents.ranges.clear();
+    for (const FileRange &range : merged)
+        contents.ranges.emplace_back(range.offset, saver.save(llvm::StringRef(range.data)));
+}
+
+std::error_code RecordingFileSystem::save(llvm::StringRef tracePath)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(tracePath, ec);
+    if (ec)
+        return ec;
+
+    // records of a kind, a path, and what was returned for that path
+    llvm::support::endian::Writer writer(os, llvm::support::little);
+    auto writeString = [&](llvm::StringRef s) {
+        writer.write<uint32_t>(s.size());
+        os << s;
+    };
+    auto writeRecord = [&](char kind, llvm::StringRef path) {
+        os << kind;
+        writeString(path);
+    };
+
+    std::lock_guard<std::mutex> lock(mutex);
+    os.write(ioTraceMagic, sizeof(ioTraceMagic));
+    for (const auto &item : trace.statuses) {
+        const llvm::vfs::Status &status = item.second;
+        writeRecord('S', item.first);
+        writer.write<uint8_t>(static_cast<uint8_t>(status.getType()));
+        writer.write<uint32_t>(status.getPermissions());
+        writer.write<uint64_t>(status.getSize());
+        writer.write<uint64_t>(status.getUniqueID().getDevice());
+        writer.write<uint64_t>(status.getUniqueID().getFile());
+        writer.write<int64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            status.getLastModificationTime().time_since_epoch()).count());
+    }
+    for (const auto &item : trace.failedStatuses) {
+        writeRecord('E', item.first);
+        writer.write<uint32_t>(item.second.value());
+    }
+    for (const auto &item : trace.listings) {
+        writeRecord('D', item.first);
+        writer.write<uint32_t>(item.second.size());
+        for (const llvm::vfs::directory_entry &entry : item.second) {
+            writeString(entry.path());
+            writer.write<uint8_t>(static_cast<uint8_t>(entry.type()));
+        }
+    }
+    for (const auto &item : trace.failedListings) {
+        writeRecord('F', item.first);
+        writer.write<uint32_t>(item.second.value());
+    }
+    for (const auto &item : trace.contents) {
+        writeRecord('R', item.first);
+        writer.write<uint64_t>(item.second.size);
+        writer.write<uint32_t>(item.second.ranges.size());
+        for (const auto &range : item.second.ranges) {
+            writer.write<uint64_t>(range.first);
+            writer.write<uint64_t>(range.second.size());
+            os << range.second;
+        }
+    }
+
+    os.close();
+    if (os.has_error())
+        return os.error();
+    return std::error_code();
+}
+
+RecordingFile::RecordingFile(std::unique_ptr<llvm::vfs::File> file, std::string path, RecordingFileSystem &fs)
+    : file(std::move(file)), path(std::move(path)), fs(fs)
+{
+}
+
+llvm::ErrorOr<llvm::vfs::Status> RecordingFile::status()
+{
+    auto statusOrError = file->status();
+    fs.recordStatus(path, statusOrError);
+    return statusOrError;
+}
+
+llvm::ErrorOr<std::string> RecordingFile::getName()
+{
+    return file->getName();
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> RecordingFile::getBuffer(const llvm::Twine &name, int64_t fileSize, bool requiresNullTerminator, bool isVolatile)
+{
+    return file->getBuffer(name, fileSize, requiresNullTerminator, isVolatile);
+}
+
+std::error_code RecordingFile::close()
+{
+    return file->close();
+}
+
+std::error_code ReplayFileSystem::load(llvm::StringRef tracePath)
+{
+    auto bufferOrError = llvm::MemoryBuffer::getFile(tracePath);
+    if (std::error_code ec = bufferOrError.getError())
+        return ec;
+
+    traceBuffer = std::move(*bufferOrError);
+    llvm::StringRef data = traceBuffer->getBuffer();
+    std::error_code invalid = std::make_error_code(std::errc::illegal_byte_sequence);
+    if (!data.startswith(llvm::StringRef(ioTraceMagic, sizeof(ioTraceMagic))))
+        return invalid;
+
+    llvm::DataExtractor extractor(data, true, 8);
+    llvm::DataExtractor::Cursor cursor(sizeof(ioTraceMagic));
+    auto readString = [&]() {
+        uint32_t size = extractor.getU32(cursor);
+        return extractor.getBytes(cursor, size).str();
+    };
+    auto readError = [&]() {
+        return std::error_code(extractor.getU32(cursor), std::generic_category());
+    };
+
+    while (cursor && cursor.tell() < data.size()) {
+        char kind = extractor.getU8(cursor);
+        std::string path = readString();
+        switch (kind) {
+        case 'S': {
+            auto type = static_cast<llvm::sys::fs::file_type>(extractor.getU8(cursor));
+            auto perms = static_cast<llvm::sys::fs::perms>(extractor.getU32(cursor));
+            uint64_t size = extractor.getU64(cursor);
+            uint64_t device = extractor.getU64(cursor);
+            uint64_t file = extractor.getU64(cursor);
+            llvm::sys::TimePoint<> mtime(std::chrono::nanoseconds(extractor.getU64(cursor)));
+            trace.statuses[path] = llvm::vfs::Status(path, llvm::sys::fs::UniqueID(device, file), mtime, 0, 0, size, type, perms);
+            break;
+        }
+        case 'E':
+            trace.failedStatuses[path] = readError();
+            break;
+        case 'D': {
+            std::vector<llvm::vfs::directory_entry> &entries = trace.listings[path];
+            for (uint32_t count = extractor.getU32(cursor); cursor && count > 0; --count) {
+                std::string entryPath = readString();
+                auto type = static_cast<llvm::sys::fs::file_type>(extractor.getU8(cursor));
+                entries.emplace_back(std::move(entryPath), type);
+            }
+            break;
+        }
+        case 'F':
+            trace.failedListings[path] = readError();
+            break;
+        case 'R': {
+            SparseContents &contents = trace.contents[path];
+            contents.size = extractor.getU64(cursor);
+            for (uint32_t count = extractor.getU32(cursor); cursor && count > 0; --count) {
+                uint64_t offset = extractor.getU64(cursor);
+                llvm::StringRef bytes = extractor.getBytes(cursor, extractor.getU64(cursor));
+                if (offset > contents.size || bytes.size() > contents.size - offset)
+                    return invalid;
+                contents.ranges.emplace_back(offset, bytes);
+            }
+            break;
+        }
+        default:
+            return invalid;
+        }
+    }
+
+    if (!cursor) {
+        llvm::consumeError(cursor.takeError());
+        return invalid;
+    }
+    return std::error_code();
+}
+
+llvm::ErrorOr<llvm::vfs::Status> ReplayFileSystem::status(const llvm::Twine &path)
+{
+    std::string filePath = path.str();
+    auto it = trace.statuses.find(filePath);
+    if (it != trace.statuses.end())
+        return it->second;
+    auto failed = trace.failedStatuses.find(filePath);
+    if (failed != trace.failedStatuses.end())
+        return failed->second;
+
+    // files read without ever being looked at
+    auto contents = trace.contents.find(filePath);
+    if (contents != trace.contents.end())
+        return llvm::vfs::Status(filePath, llvm::vfs::getNextVirtualUniqueID(), llvm::sys::TimePoint<>(), 0, 0,
+                                 contents->second.size, llvm::sys::fs::file_type::regular_file, llvm::sys::fs::all_read);
+    return std::make_error_code(std::errc::no_such_file_or_directory);
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>> ReplayFileSystem::openFileForRead(const llvm::Twine &path)
+{
+    std::string filePath = path.str();
+    auto contents = trace.contents.find(filePath);
+    if (contents == trace.contents.end()) {
+        auto failed = trace.failedStatuses.find(filePath);
+        return failed != trace.failedStatuses.end() ? failed->second : std::make_error_code(std::errc::no_such_file_or_directory);
+    }
+
+    auto statusOrError = status(filePath);
+    if (std::error_code ec = statusOrError.getError())
+        return ec;
+    return std::unique_ptr<llvm::vfs::File>(new ReplayFile(*statusOrError, contents->second));
+}
+
+llvm::vfs::directory_iterator ReplayFileSystem::dir_begin(const llvm::Twine &dir, std::error_code &ec)
+{
+    std::string dirPath = dir.str();
+    auto it = trace.listings.find(dirPath);
+    if (it != trace.listings.end()) {
+        ec = std::error_code();
+        return llvm::vfs::directory_iterator(std::make_shared<ListedDirIterator>(it->second));
+    }
+    auto failed = trace.failedListings.find(dirPath);
+    ec = (failed != trace.failedListings.end()) ? failed->second : std::make_error_code(std::errc::no_such_file_or_directory);
+    return llvm::vfs::directory_iterator();
+}
+
+std::error_code ReplayFileSystem::setCurrentWorkingDirectory(const llvm::Twine &path)
+{
+    workingDirectory = path.str();
+    return std::error_code();
+}
+
+llvm::ErrorOr<std::string> ReplayFileSystem::getCurrentWorkingDirectory() const
+{
+    return workingDirectory;
+}
+
+ReplayFile::ReplayFile(llvm::vfs::Status status, const SparseContents &contents)
+    : fileStatus(std::move(status)), contents(contents)
+{
+}
+
+llvm::ErrorOr<llvm::vfs::Status> ReplayFile::status()
+{
+    return fileStatus;
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> ReplayFile::getBuffer(const llvm::Twine &name, int64_t, bool, bool)
+{
+    // what was not read is left zeroed, the parser only checks it is there
+    std::unique_ptr<llvm::WritableMemoryBuffer> buffer = llvm::WritableMemoryBuffer::getNewMemBuffer(contents.size, name);
+    if (!buffer)
+        return std::make_error_code(std::errc::not_enough_memory);
+    for (const auto &range : contents.ranges)
+        std::memcpy(buffer->getBufferStart() + range.first, range.second.data(), range.second.size());
+    return std::unique_ptr<llvm::MemoryBuffer>(std::move(buffer));
+}
+
+std::error_code ReplayFile::close()
+{
+    return std::error_code();
+}
+
+ListedDirIterator::ListedDirIterator(std::vector<llvm::vfs::directory_entry> entries)
+    : entries(std::move(entries))
+{
+    increment();
+}
+
+std::error_code ListedDirIterator::increment()
+{
+    CurrentEntry = (next < entries.size()) ? entries[next++] : llvm::vfs::directory_entry();
+    return std::error_code();
+}
+
+Logger::Logger()
+    : start(std::chrono::steady_clock::now())
+{
+}
+
+void Logger::configure(LogLevel level, LogFormat format)
+{
+    this->level = level;
+    this->format = format;
+}
+
+void Logger::write(const LogEvent &event)
+{
+    // warnings and errors, DLLs not found among them, are not held back
+    // until the copies are done
+    if (enabled(event.level))
+        append(event, event.level <= LogLevel::Warning);
+}
+
+void Logger::writeStats(const LogEvent &event)
+{
+    append(event, true);
+}
+
+void Logger::append(const LogEvent &event, bool writeNow)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    llvm::raw_string_ostream os(buffer);
+    if (format == LogFormat::Ndjson)
+        writeJson(os, event);
+    else
+        writeText(os, event);
+    os.flush();
+
+    if (writeNow || buffer.size() >= logBufferSize) {
+        llvm::errs() << buffer;
+        buffer.clear();
+    }
+}
+
+void Logger::flush()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    llvm::errs() << buffer;
+    buffer.clear();
+}
+
+void Logger::writeText(llvm::raw_ostream &os, const LogEvent &event)
+{
+    llvm::StringRef kind = event.kind;
+    if (kind == "skip")
+        os << "Skipped: " << event.path << "\n";
+    else if (kind == "not-found")
+        os << "Not found: " << event.name << "\n";
+    else if (kind == "unchanged")
+        os << "Unchanged: " << event.path << "\n";
+    else if (kind == "resume")
+        os << "Already copied: " << event.path << "\n";
+    else if (kind == "copy")
+        os << event.path << " -> " << event.destination << "\n";
+    else if (kind == "patch")
+        os << "Patched: " << event.path << " (" << event.bytes << " bytes)\n";
+    else if (kind == "resolve")
+        os << "Resolved: " << event.name << " -> " << event.path << " (" << event.duration << " us)\n";
+    else if (kind == "replay")
+        os << "Replay: " << event.message << "\n";
+    else if (kind == "io-stats")
+        os << "I/O: " << event.message << "\n";
+    else if (kind == "concurrency")
+        os << "Concurrency: " << event.message << "\n";
+    else if (kind == "memory")
+        os << "Memory: " << event.message << "\n";
+    else
+        os << event.path << ": " << event.message << "\n";
+}
+
+void Logger::writeJson(llvm::raw_ostream &os, const LogEvent &event)
+{
+    static const char *const levelNames[] = {"error", "warning", "info", "verbose"};
+
+    // file names are not necessarily UTF-8, which JSON strings must be
+    auto jsonString = [](llvm::StringRef s) {
+        return llvm::json::isUTF8(s) ? s.str() : llvm::json::fixUTF8(s);
+    };
+
+    llvm::json::Object object;
+    object["time_us"] = getMicroseconds(start);
+    object["level"] = levelNames[static_cast<int>(event.level)];
+    object["event"] = event.kind;
+    if (!event.name.empty())
+        object["name"] = jsonString(event.name);
+    if (!event.path.empty())
+        object["path"] = jsonString(event.path);
+    if (!event.destination.empty())
+        object["destination"] = jsonString(event.destination);
+    if (!event.message.empty())
+        object["message"] = jsonString(event.message);
+    if (event.bytes)
+        object["bytes"] = int64_t(event.bytes);
+    if (event.duration >= 0)
+        object["duration_us"] = event.duration;
+    os << llvm::json::Value(std::move(object)) << "\n";
+}
+
+// allocates for the operators below, calling the new handler until the
+// allocation succeeds or no handler is left; null then
+void *allocateCounted(size_t size)
+{
+    if (allocCountingEnabled) {
+        allocCounters.allocations.fetch_add(1, std::memory_order_relaxed);
+        allocCounters.bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    if (size == 0)
+        size = 1;
+    for (;;) {
+        if (void *ptr = std::malloc(size))
+            return ptr;
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            return nullptr;
+        handler();
+    }
+}
+
+// replaces the global allocation functions to count what goes through them,
+// the nothrow forms included as LLVM frees their memory with plain delete;
+// kept out of line as the compiler takes inlined malloc() and free() calls
+// for mismatched allocations
+LLVM_ATTRIBUTE_NOINLINE void *operator new(size_t size)
+{
+    void *ptr = allocateCounted(size);
+    if (!ptr) {
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+        throw std::bad_alloc();
+#else
+        llvm::report_bad_alloc_error("Allocation failed");
+#endif
+    }
+    return ptr;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+LLVM_ATTRIBUTE_NOINLINE void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+    try {
+        return allocateCounted(size);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+#else
+    return allocateCounted(size);
+#endif
+}
+
+void *operator new[](size_t size, const std::nothrow_t &tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+LLVM_ATTRIBUTE_NOINLINE void operator delete(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    operator delete(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    operator delete(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    operator delete(ptr);
 }
 
 #if LLVM_VERSION_MAJOR < 11
-llvm::raw_ostream &operator<<(llvm::raw_ostream &os, const std::error_code &ec)
+std::string getErrorMessage(std::error_code ec)
 {
-    return os << ec.message();
+    return ec.message();
 }
 #endif
+
+std::string getErrorMessage(llvm::Error err)
+{
+    return llvm::toString(std::move(err));
+}
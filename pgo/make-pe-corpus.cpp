@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: BSL-1.0
+
+// Generates an application and a layered graph of PE32+ DLLs spread over
+// several search directories, as the workload of the profile-guided build.
+// The DLLs have static and delay-loaded imports, base relocations and
+// padding up to realistic sizes, some names are shadowed by DLLs of the
+// wrong architecture, and every DLL imports a system DLL which is not found.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#if defined(_WIN32)
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
+
+struct ImageImport {
+    std::string dll;
+    std::vector<std::string> functions;
+    bool delayLoaded = false;
+};
+
+struct ImageSpec {
+    std::vector<ImageImport> imports;
+    uint32_t relocations = 0;
+    uint32_t padding = 0;
+    uint16_t machine = 0x8664;
+    bool dll = true;
+};
+
+static const uint32_t sectionBase = 0x1000;
+static const uint32_t sectionAlignment = 0x1000;
+static const uint32_t fileAlignment = 0x200;
+static const uint64_t imageBase = 0x180000000;
+
+static std::string makeImage(const ImageSpec &spec);
+static bool writeFile(const std::string &path, const std::string &data);
+static bool makeDirectory(const std::string &path);
+static uint32_t nextRandom(uint64_t &state);
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 4) {
+        std::fprintf(stderr, "Usage: make-pe-corpus <directory> [dlls] [search-directories]\n");
+        return 1;
+    }
+
+    std::string directory = argv[1];
+    unsigned dllCount = (argc > 2) ? std::strtoul(argv[2], nullptr, 10) : 400;
+    unsigned directoryCount = (argc > 3) ? std::strtoul(argv[3], nullptr, 10) : 8;
+    if (dllCount < 8 || directoryCount == 0) {
+        std::fprintf(stderr, "At least 8 DLLs and one search directory are needed.\n");
+        return 1;
+    }
+
+    if (!makeDirectory(directory) || !makeDirectory(directory + "/app"))
+        return 1;
+    for (unsigned i = 0; i < directoryCount; ++i) {
+        if (!makeDirectory(directory + "/lib" + std::to_string(i)))
+            return 1;
+    }
+
+    // DLLs only import DLLs with a larger index, the application imports
+    // the first few, and every DLL is imported at least once
+    uint64_t state = 0x9e3779b97f4a7c15;
+    std::vector<ImageSpec> images(dllCount);
+    auto dllName = [](unsigned i) {
+        char name[24];
+        std::snprintf(name, sizeof(name), "lib%04u.dll", i);
+        return std::string(name);
+    };
+    auto addImport = [&](ImageSpec &image, unsigned i) {
+        ImageImport import;
+        import.dll = dllName(i);
+        import.delayLoaded = nextRandom(state) % 8 == 0;
+        for (unsigned j = 0, count = 1 + nextRandom(state) % 20; j < count; ++j)
+            import.functions.push_back("function" + std::to_string(j));
+        image.imports.push_back(import);
+    };
+
+    ImageSpec application;
+    application.dll = false;
+    for (unsigned i = 0; i < 8; ++i)
+        addImport(application, i);
+
+    for (unsigned i = 0; i < dllCount; ++i) {
+        ImageSpec &image = images[i];
+        if (i >= 8)
+            addImport(images[nextRandom(state) % i], i);
+        for (unsigned j = 0, count = nextRandom(state) % 4; j < count && i + 1 < dllCount; ++j)
+            addImport(image, i + 1 + nextRandom(state) % (dllCount - i - 1));
+        image.relocations = nextRandom(state) % 2000;
+        image.padding = 4096 + nextRandom(state) % (124 << 10);
+    }
+
+    for (unsigned i = 0; i < dllCount; ++i) {
+        ImageImport system;
+        system.dll = "kernel32.dll";
+        system.functions.push_back("GetProcAddress");
+        images[i].imports.push_back(system);
+
+        unsigned home = i % directoryCount;
+        std::string path = directory + "/lib" + std::to_string(home) + "/" + dllName(i);
+        if (!writeFile(path, makeImage(images[i])))
+            return 1;
+
+        // a 32-bit DLL of the same name, in a directory searched earlier
+        if (i % 10 == 0 && home > 0) {
+            ImageSpec shadow = images[i];
+            shadow.machine = 0x14c;
+            shadow.padding = 0;
+            if (!writeFile(directory + "/lib0/" + dllName(i), makeImage(shadow)))
+                return 1;
+        }
+    }
+
+    return writeFile(directory + "/app/app.exe", makeImage(application)) ? 0 : 1;
+}
+
+std::string makeImage(const ImageSpec &spec)
+{
+    std::string data;
+    auto here = [&]() { return uint32_t(sectionBase + data.size()); };
+    auto align = [](uint64_t value, uint64_t alignment) { return (value + alignment - 1) / alignment * alignment; };
+    auto alignData = [&](size_t alignment) { data.resize(align(data.size(), alignment)); };
+    auto put = [](std::string &out, uint64_t value, unsigned size) {
+        for (unsigned i = 0; i < size; ++i)
+            out.push_back(char(value >> (8 * i)));
+    };
+    auto putString = [&](const std::string &s) {
+        uint32_t rva = here();
+        data.append(s);
+        data.push_back('\0');
+        return rva;
+    };
+    auto putHintNames = [&](const std::vector<std::string> &functions) {
+        std::vector<uint32_t> rvas;
+        for (const std::string &function : functions) {
+            alignData(2);
+            rvas.push_back(here());
+            put(data, 0, 2);
+            putString(function);
+        }
+        return rvas;
+    };
+    auto putThunks = [&](const std::vector<uint32_t> &rvas) {
+        uint32_t rva = here();
+        for (uint32_t hintName : rvas)
+            put(data, hintName, 8);
+        put(data, 0, 8);
+        return rva;
+    };
+
+    // import and delay import descriptors, then the padding, in one section
+    uint32_t directories[16][2] = {};
+    std::string descriptors;
+    std::string delayDescriptors;
+    for (const ImageImport &import : spec.imports) {
+        uint32_t name = putString(import.dll);
+        std::vector<uint32_t> hintNames = putHintNames(import.functions);
+        alignData(8);
+        if (import.delayLoaded) {
+            uint32_t module = here();
+            put(data, 0, 8);
+            uint32_t nameTable = putThunks(hintNames);
+            uint32_t addressTable = here();
+            data.append(8 * (hintNames.size() + 1), '\0');
+            for (uint32_t value : {uint32_t(1), name, module, addressTable, nameTable, uint32_t(0), uint32_t(0), uint32_t(0)})
+                put(delayDescriptors, value, 4);
+        }
+        else {
+            uint32_t lookupTable = putThunks(hintNames);
+            uint32_t addressTable = putThunks(hintNames);
+            for (uint32_t value : {lookupTable, uint32_t(0), uint32_t(0), name, addressTable})
+                put(descriptors, value, 4);
+        }
+    }
+    if (!descriptors.empty()) {
+        alignData(8);
+        directories[1][0] = here();
+        directories[1][1] = descriptors.size() + 20;
+        data.append(descriptors);
+        data.append(20, '\0');
+    }
+    if (!delayDescriptors.empty()) {
+        alignData(8);
+        directories[13][0] = here();
+        directories[13][1] = delayDescriptors.size() + 32;
+        data.append(delayDescriptors);
+        data.append(32, '\0');
+    }
+    data.append(spec.padding, 'Z');
+    if (data.empty())
+        data.append(16, '\0');
+
+    // one block of up to 64 relocations per page
+    std::string relocations;
+    for (uint32_t left = spec.relocations, page = sectionBase; left > 0; page += sectionAlignment) {
+        uint32_t count = std::min(left, uint32_t(64));
+        uint32_t entries = count + (count % 2);
+        put(relocations, page, 4);
+        put(relocations, 8 + 2 * entries, 4);
+        for (uint32_t i = 0; i < entries; ++i)
+            put(relocations, (i < count) ? (10 << 12) | (i * 8) : 0, 2);
+        left -= count;
+    }
+
+    struct Section {
+        const char *name;
+        uint32_t rva;
+        const std::string *contents;
+        uint32_t characteristics;
+    };
+    std::vector<Section> sections = {{".rdata", sectionBase, &data, 0x40000040}};
+    uint32_t nextRva = align(sectionBase + data.size(), sectionAlignment);
+    if (!relocations.empty()) {
+        sections.push_back({".reloc", nextRva, &relocations, 0x42000040});
+        directories[5][0] = nextRva;
+        directories[5][1] = relocations.size();
+        nextRva = align(nextRva + relocations.size(), sectionAlignment);
+    }
+
+    uint32_t headerSize = align(0x40 + 4 + 20 + 240 + 40 * sections.size(), fileAlignment);
+    std::string image(0x3c, '\0');
+    image[0] = 'M';
+    image[1] = 'Z';
+    put(image, 0x40, 4);
+    image.append("PE\0\0", 4);
+
+    put(image, spec.machine, 2);
+    put(image, sections.size(), 2);
+    put(image, 0, 4);
+    put(image, 0, 4);
+    put(image, 0, 4);
+    put(image, 240, 2);
+    put(image, spec.dll ? 0x2022 : 0x0022, 2);
+
+    // PE32+ optional header, with relocatable images marked dynamic base
+    put(image, 0x20b, 2);
+    put(image, 14, 1);
+    put(image, 0, 1);
+    put(image, 0, 4);
+    put(image, data.size(), 4);
+    put(image, 0, 4);
+    put(image, 0, 4);
+    put(image, sectionBase, 4);
+    put(image, imageBase, 8);
+    put(image, sectionAlignment, 4);
+    put(image, fileAlignment, 4);
+    for (uint32_t version : {6, 0, 0, 0, 6, 0})
+        put(image, version, 2);
+    put(image, 0, 4);
+    put(image, nextRva, 4);
+    put(image, headerSize, 4);
+    put(image, 0, 4);
+    put(image, 3, 2);
+    put(image, 0x0100 | (spec.relocations ? 0x0040 : 0), 2);
+    for (uint64_t size : {0x100000, 0x1000, 0x100000, 0x1000})
+        put(image, size, 8);
+    put(image, 0, 4);
+    put(image, 16, 4);
+    for (const auto &directory : directories) {
+        put(image, directory[0], 4);
+        put(image, directory[1], 4);
+    }
+
+    uint32_t rawOffset = headerSize;
+    for (const Section &section : sections) {
+        std::string name(section.name);
+        name.resize(8, '\0');
+        image.append(name);
+        put(image, section.contents->size(), 4);
+        put(image, section.rva, 4);
+        put(image, align(section.contents->size(), fileAlignment), 4);
+        put(image, rawOffset, 4);
+        put(image, 0, 4);
+        put(image, 0, 4);
+        put(image, 0, 2);
+        put(image, 0, 2);
+        put(image, section.characteristics, 4);
+        rawOffset += align(section.contents->size(), fileAlignment);
+    }
+
+    image.resize(headerSize, '\0');
+    for (const Section &section : sections) {
+        image.append(*section.contents);
+        image.resize(align(image.size(), fileAlignment), '\0');
+    }
+    return image;
+}
+
+bool writeFile(const std::string &path, const std::string &data)
+{
+    FILE *file = std::fopen(path.c_str(), "wb");
+    bool written = file && std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    if (file && std::fclose(file) != 0)
+        written = false;
+    if (!written)
+        std::perror(path.c_str());
+    return written;
+}
+
+bool makeDirectory(const std::string &path)
+{
+#if defined(_WIN32)
+    int result = _mkdir(path.c_str());
+#else
+    int result = mkdir(path.c_str(), 0777);
+#endif
+    if (result != 0 && errno != EEXIST) {
+        std::perror(path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// xorshift64*, so every run generates the same corpus
+uint32_t nextRandom(uint64_t &state)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return uint32_t((state * 0x2545f4914f6cdd1d) >> 32);
+}
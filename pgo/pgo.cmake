@@ -0,0 +1,119 @@
+# Runs the steps of the dll-bundler-pgo target: builds dll-bundler
+# instrumented, trains it on a generated PE corpus, rebuilds it with the
+# profile and link-time optimization, then has the regular and the optimized
+# binaries replay the same recorded resolution to report the speedup.
+#
+# cmake -DSOURCE_DIR=dir -DBINARY_DIR=dir -DBASELINE=dll-bundler
+#       -DCORPUS_TOOL=make-pe-corpus -DGENERATOR=generator
+#       -DCXX_COMPILER=compiler -DCXX_COMPILER_ID=id -DLLVM_DIR=dir
+#       [-DPROFDATA=llvm-profdata] [-DEXECUTABLE_SUFFIX=.exe] [-DRUNS=20]
+#       -P pgo.cmake
+
+cmake_minimum_required(VERSION 3.14)
+
+set(BUILD_DIR "${BINARY_DIR}/build")
+set(PROFILE_DIR "${BINARY_DIR}/profile")
+set(CORPUS_DIR "${BINARY_DIR}/corpus")
+if(NOT RUNS)
+    set(RUNS 20)
+endif()
+
+function(run)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Failed: ${ARGN}")
+    endif()
+endfunction()
+
+# the runs log every DLL, which is of no interest here
+function(run_quietly)
+    execute_process(COMMAND ${ARGN} RESULT_VARIABLE result OUTPUT_QUIET ERROR_QUIET)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "Failed: ${ARGN}")
+    endif()
+endfunction()
+
+function(build_stage profile)
+    run(${CMAKE_COMMAND} -S ${SOURCE_DIR} -B ${BUILD_DIR} -G ${GENERATOR}
+        -DCMAKE_BUILD_TYPE=Release
+        -DCMAKE_CXX_COMPILER=${CXX_COMPILER}
+        -DLLVM_DIR=${LLVM_DIR}
+        -DDLL_BUNDLER_PGO=OFF
+        -DDLL_BUNDLER_PROFILE=${profile}
+        -DDLL_BUNDLER_PROFILE_DIR=${PROFILE_DIR}
+        ${ARGN})
+    run(${CMAKE_COMMAND} --build ${BUILD_DIR} --target dll-bundler)
+endfunction()
+
+file(MAKE_DIRECTORY ${BINARY_DIR})
+if(NOT EXISTS "${CORPUS_DIR}/app/app.exe")
+    run(${CORPUS_TOOL} ${CORPUS_DIR})
+endif()
+file(GLOB searchDirs LIST_DIRECTORIES true "${CORPUS_DIR}/lib*")
+set(searchArgs)
+foreach(searchDir IN LISTS searchDirs)
+    list(APPEND searchArgs -L ${searchDir})
+endforeach()
+set(app "${CORPUS_DIR}/app/app.exe")
+set(trace "${BINARY_DIR}/trace")
+
+# GCC keeps its profiles next to the objects, and both stages share the
+# build directory so that the objects, and the profiles, keep their names
+message(STATUS "Building the instrumented dll-bundler")
+file(REMOVE_RECURSE ${PROFILE_DIR} "${BINARY_DIR}/hashes" "${BINARY_DIR}/lock")
+file(GLOB_RECURSE oldProfiles "${BUILD_DIR}/*.gcda")
+if(oldProfiles)
+    file(REMOVE ${oldProfiles})
+endif()
+build_stage(generate -DCMAKE_INTERPROCEDURAL_OPTIMIZATION=OFF)
+
+# the ways the build farm runs the bundler
+message(STATUS "Training on ${CORPUS_DIR}")
+set(instrumented "${BUILD_DIR}/dll-bundler${EXECUTABLE_SUFFIX}")
+run_quietly(${instrumented} ${searchArgs} ${app})
+run_quietly(${instrumented} --hash-cache=${BINARY_DIR}/hashes --lock ${BINARY_DIR}/lock ${searchArgs} ${app})
+run_quietly(${instrumented} --hash-cache=${BINARY_DIR}/hashes --delta-from ${BINARY_DIR}/lock ${searchArgs} ${app})
+run_quietly(${instrumented} --emit-env --load-report --delay-report --base-report ${searchArgs} ${app})
+run_quietly(${instrumented} --emit-env --in-memory ${searchArgs} ${app})
+run_quietly(${instrumented} --emit-env --record-io ${trace} ${searchArgs} ${app})
+run_quietly(${instrumented} --replay-io ${trace} ${searchArgs} ${app})
+
+if(CXX_COMPILER_ID MATCHES "Clang")
+    file(GLOB rawProfiles "${PROFILE_DIR}/*.profraw")
+    run(${PROFDATA} merge -o ${PROFILE_DIR}/dll-bundler.profdata ${rawProfiles})
+endif()
+
+message(STATUS "Building the optimized dll-bundler")
+build_stage(use -DCMAKE_INTERPROCEDURAL_OPTIMIZATION=ON)
+set(optimized "${BUILD_DIR}/dll-bundler${EXECUTABLE_SUFFIX}")
+
+# the binaries take turns, so that neither is favored by the state of the
+# machine, and only the resolution is timed, which copies would dwarf
+run_quietly(${BASELINE} -q --emit-env --record-io ${trace} ${searchArgs} ${app})
+set(baselineTotal 0)
+set(optimizedTotal 0)
+foreach(i RANGE 1 ${RUNS})
+    foreach(binary IN ITEMS baseline optimized)
+        if(binary STREQUAL "baseline")
+            set(program ${BASELINE})
+        else()
+            set(program ${optimized})
+        endif()
+        execute_process(COMMAND ${program} -q --replay-io ${trace} ${searchArgs} ${app}
+                        RESULT_VARIABLE result OUTPUT_QUIET ERROR_VARIABLE output)
+        if(NOT result EQUAL 0 OR NOT output MATCHES "resolved in ([0-9]+) us")
+            message(FATAL_ERROR "Failed to replay ${trace} with ${program}")
+        endif()
+        math(EXPR ${binary}Total "${${binary}Total} + ${CMAKE_MATCH_1}")
+    endforeach()
+endforeach()
+
+math(EXPR speedup "${baselineTotal} * 100 / (${optimizedTotal} + 1)")
+math(EXPR speedupUnits "${speedup} / 100")
+math(EXPR speedupHundredths "${speedup} % 100")
+if(speedupHundredths LESS 10)
+    set(speedupHundredths "0${speedupHundredths}")
+endif()
+message(STATUS "Resolution time over ${RUNS} replays: ${baselineTotal} us regular, ${optimizedTotal} us optimized")
+message(STATUS "Speedup: ${speedupUnits}.${speedupHundredths}x")
+message(STATUS "Optimized dll-bundler: ${optimized}")